@@ -3,6 +3,7 @@
 
 #include <intuition/intuition.h>
 #include <exec/exec.h>
+#include <dos/dos.h>
 
 #include <clib/intuition_protos.h>
 #include <clib/exec_protos.h>
@@ -31,6 +32,134 @@ typedef struct List IDCMPList;
    IDCMP_REFRESHWINDOW | IDCMP_REQCLEAR | IDCMP_REQSET | IDCMP_REQVERIFY | \
    IDCMP_SIZEVERIFY | IDCMP_VANILLAKEY | IDCMP_WBENCHMESSAGE)
 
+/*
+ * The verify classes freeze Intuition (menus, sizing or requesters for the
+ * whole screen) until the message is replied, so they are answered as soon
+ * as they are pulled from the UserPort rather than after the handlers run.
+ */
+#define VERIFY_IDCMP_EVENTS (\
+   IDCMP_MENUVERIFY | IDCMP_SIZEVERIFY | IDCMP_REQVERIFY)
+
+/*
+ * A suggested value for an IDCMPEvents' BulkClasses, which is 0 unless the
+ * application opts in. After a batch is drained the verify classes are
+ * dispatched first, then every class not in BulkClasses, such as a close,
+ * menu or key, and only then the bulk classes; arrival order is kept
+ * within each of these lanes. Buttons and gadget presses are bulk along
+ * with the motion so that drags and freehand drawing see them in order.
+ */
+#define BULK_IDCMP_EVENTS (\
+   IDCMP_MOUSEMOVE | IDCMP_INTUITICKS | IDCMP_DELTAMOVE | \
+   IDCMP_MOUSEBUTTONS | IDCMP_GADGETDOWN | IDCMP_GADGETUP)
+
+/*
+ * High frequency classes that may be stripped from a window's IDCMP flags
+ * by the load shedding policy while the UserPort is backing up. See the
+ * `SetIDCMPLoadShedding` function.
+ */
+#define SHEDDABLE_IDCMP_EVENTS (\
+   IDCMP_MOUSEMOVE | IDCMP_INTUITICKS | IDCMP_DELTAMOVE)
+
+/*
+ * Suggested load shedding thresholds for a stock 7 MHz machine; messages
+ * waiting per wakeup before shedding, messages per wakeup considered calm
+ * and the number of consecutive calm wakeups before the classes return.
+ */
+#define IDCMP_SHED_HIGH_WATER 24
+#define IDCMP_SHED_LOW_WATER 4
+#define IDCMP_SHED_RESTORE_WAKEUPS 3
+
+/*
+ * IDCMP_IDCMPUPDATE tag lists are freed by Intuition once the message is
+ * replied, so up to IDCMP_UPDATE_MAX_TAGS tags of each are copied into an
+ * `IDCMPUpdateRecord` beforehand. A batch holds at most IDCMP_UPDATE_SLOTS
+ * such records, by default one for every message, so BOOPSI gadgets
+ * reporting at mouse rate never cut a batch short. IDCMP_UPDATE_MAX_TAGS
+ * sizes a public structure shared with a prebuilt library and so is fixed.
+ */
+#define IDCMP_UPDATE_MAX_TAGS 6
+
+#ifndef IDCMP_UPDATE_SLOTS
+#define IDCMP_UPDATE_SLOTS IDCMP_BATCH_SIZE
+#endif
+
+/* GadgetID of an IDCMPUpdateRecord whose tag list carried no GA_ID */
+#define IDCMP_UPDATE_NO_ID 0xFFFFFFFF
+
+/*
+ * The most messages a single `PollIDCMPEvents` call can return, and so the
+ * length of each of the arrays in an `IDCMPPollBatch`. The library writes
+ * up to this many entries into the caller's batch, so it is fixed rather
+ * than left for the application to override.
+ */
+#define IDCMP_POLL_CAPACITY 64
+
+/*
+ * The default number of microseconds an idle job is allowed per slice
+ * before it should hand control back so the UserPort can be checked.
+ */
+#ifndef IDCMP_IDLE_BUDGET
+#define IDCMP_IDLE_BUDGET 4000
+#endif
+
+/*
+ * The gadget hit-test index divides the window into square cells of
+ * (1 << IDCMP_HIT_CELL_SHIFT) pixels; 32 pixels keeps the number of gadgets
+ * sharing a cell small for typical toolbar and button sizes.
+ */
+#ifndef IDCMP_HIT_CELL_SHIFT
+#define IDCMP_HIT_CELL_SHIFT 5
+#endif
+
+/*
+ * The number of messages `ProcessIDCMPMessage` pulls from the UserPort,
+ * copies and replies before it begins dispatching them. Each slot costs a
+ * little over one `struct IntuiMessage`, allocated with the events.
+ */
+#ifndef IDCMP_BATCH_SIZE
+#define IDCMP_BATCH_SIZE 16
+#endif
+
+/*
+ * Verify messages are not left behind when a batch fills up; the UserPort
+ * is searched for them whenever a batch fills and before every message is
+ * dispatched, so Intuition waits for at most one handler. Those found this
+ * way are answered at once and their copies dispatched ahead of the rest
+ * of the batch, space permitting; any beyond IDCMP_VERIFY_SLOTS per batch
+ * are still answered, only their handlers are not called.
+ */
+#ifndef IDCMP_VERIFY_SLOTS
+#define IDCMP_VERIFY_SLOTS 4
+#endif
+
+/*
+ * The number of entries kept by each window's flight recorder. Each entry
+ * costs 24 bytes, allocated by `InitializeIDCMPEvents` rather than kept in
+ * IDCMPEvents itself; it must be a power of two.
+ */
+#ifndef IDCMP_FLIGHT_RECORDS
+#define IDCMP_FLIGHT_RECORDS 32
+#endif
+
+/*
+ * The number of events `PostIDCMPEvent` can hold for a window until they
+ * are dispatched. Each costs 20 bytes in the queue allocated by
+ * `EnableIDCMPPosting`; it must be a power of two.
+ */
+#ifndef IDCMP_POST_CAPACITY
+#define IDCMP_POST_CAPACITY 16
+#endif
+
+/*
+ * The class of application defined events posted with `PostIDCMPEvent`;
+ * they are dispatched to the AppEvent handler, with the application's own
+ * event number in Code and its data in IAddress. Intuition does not use
+ * this bit.
+ */
+#ifndef IDCMP_APPEVENT
+#define IDCMP_APPEVENT 0x40000000L
+#endif
+
 typedef enum IDCMPMouseButton {
    LEFT_MOUSE_UP = SELECTUP,
    LEFT_MOUSE_DOWN = SELECTDOWN,
@@ -47,10 +176,24 @@ typedef enum  IDCMPState {
     STATE_NO_CHANGE = 2
 }  IDCMPState;
 
+typedef enum IDCMPVerifyAnswer {
+   VERIFY_ALLOW = 0,
+   VERIFY_CANCEL = 1,
+   VERIFY_DEFER = 2
+} IDCMPVerifyAnswer;
+
 typedef enum GadgetEventType {
    GADGET_UP = 1,
    GADGET_DOWN = 2,
-   GADGET_HELP = 4
+   GADGET_HELP = 4,
+   GADGET_ENTER = 8,
+   GADGET_LEAVE = 16,
+
+   /*
+    * Marks the nodes of `AddGadgetValueStream`; ignored when passed to the
+    * other add functions, but usable with `RemoveGadgetHandlersByType`
+    */
+   GADGET_VALUE = 32
 } GadgetEventType;
 
 /**
@@ -58,12 +201,17 @@ typedef enum GadgetEventType {
  * a window and the IntuiMessage structures present when a gadget is either
  * in the down, up or help states. Additionally the type denotes which of
  * those states were indicated. These are numbered to be operated on in a 
- * bitmask state.
+ * bitmask state. `ProcessIDCMPMessage` invokes them for IDCMP_GADGETDOWN,
+ * IDCMP_GADGETUP and IDCMP_GADGETHELP messages ahead of the handler table's
+ * GadgetDown, GadgetUp or GadgetHelp. When the hit-test index is enabled,
+ * handlers registered with GADGET_ENTER or GADGET_LEAVE are also invoked as
+ * the pointer moves onto or off of their gadget.
  * 
  * @param gadget the gadget being evented
  * @param window the window pertaining to the gadget event
  * @param message the IntuiMessage structure indicating the event
- * @param type the gadget state; GADGET_UP, GADGET_DOWN or GADGET_HELP
+ * @param type the gadget state; GADGET_UP, GADGET_DOWN, GADGET_HELP,
+ * GADGET_ENTER or GADGET_LEAVE
  * @return TRUE if the clicking of this gadget should terminate the event
  * loop, FALSE if not.
  */
@@ -80,31 +228,265 @@ typedef BOOL (*IDCMPGadgetHandler)(
  * IDCMPEvents structure instance.
  * 
  * Specifically it supports the matcher type, the event type, a pointer to 
- * the Gadget and a pointer to the function that should be executed.
+ * the Gadget and a pointer to the function that should be executed. The
+ * bounds are the window relative rectangle the gadget was last indexed
+ * with by the hit-test index, if that is enabled. Nodes registered in bulk
+ * share a single allocation, the block, which is released along with the
+ * last of its nodes.
  */
 typedef struct GadgetEventNode {
    struct Node node;
    GadgetEventType type;
    IDCMPGadget *gadget;
    IDCMPGadgetHandler handler;
+   struct Rectangle bounds;
+   struct GadgetEventBlock *block;
 } GadgetEventNode;
 
 /**
- * The IDCMPEvents structure contains each of the various IDCMP events that
+ * A single entry for `AddGadgetHandlers`, mirroring the arguments that
+ * would otherwise be passed to `AddGadgetHandler` one gadget at a time.
+ */
+typedef struct GadgetHandlerBinding {
+   IDCMPGadget *gadget;
+   IDCMPGadgetHandler handler;
+   GadgetEventType type;
+} GadgetHandlerBinding;
+
+/* Private uniform grid used by the gadget hit-test index */
+struct IDCMPHitGrid;
+
+/**
+ * The decoded form of an IDCMP_IDCMPUPDATE tag list, captured before the
+ * message is replied. Tags is a TAG_DONE terminated copy of the first
+ * IDCMP_UPDATE_MAX_TAGS tags, always including GA_ID when present, and is
+ * what the batch copy's `IAddress` points at, so `GetTagData()` keeps
+ * working in an `IdcmpUpdate` handler. Tags must remain the first member.
+ */
+typedef struct IDCMPUpdateRecord {
+   struct TagItem Tags[IDCMP_UPDATE_MAX_TAGS + 1];
+   ULONG GadgetID;
+   UWORD Count;
+} IDCMPUpdateRecord;
+
+/**
+ * An UpdateHandler receives IDCMP_IDCMPUPDATE messages routed to it by the
+ * GA_ID of the BOOPSI object that sent them. See `SetIDCMPUpdateRoute`.
+ * 
+ * @param window the window the message was received on
+ * @param message the batch copy of the message
+ * @param update the decoded tag list; valid only for the duration of the
+ * call
+ * @return an IDCMPState just like any other IDCMP handler
+ */
+typedef IDCMPState (*IDCMPUpdateHandler)(
+   IDCMPWindow *window,
+   IDCMPMessage *message,
+   const IDCMPUpdateRecord *update
+);
+
+/**
+ * Describes the slice of time an idle job has been given; the moment it
+ * began, as reported by `CurrentTime()`, and how long it may run for. Pass
+ * it to `IdleSliceExpired` to find out whether it is time to return.
+ */
+typedef struct IDCMPIdleSlice {
+   ULONG Seconds;
+   ULONG Micros;
+   ULONG Budget;
+} IDCMPIdleSlice;
+
+/**
+ * An IdleJob performs background work in small pieces whenever the
+ * window's UserPort is empty. Each call should do a slice of work, checking
+ * `IdleSliceExpired` as it goes, and then return so that input is never
+ * kept waiting for longer than the slice's budget.
+ * 
+ * @param window the window whose event loop is running the job
+ * @param data the data pointer given to `AddIdleJob`
+ * @param slice the time this call may use
+ * @return TRUE while there is more work to do; FALSE once the job is
+ * finished, at which point it is removed from the queue
+ */
+typedef BOOL (*IDCMPIdleJob)(
+   IDCMPWindow *window,
+   APTR data,
+   IDCMPIdleSlice *slice
+);
+
+/**
+ * The Exec List Node variant used to queue idle jobs on an IDCMPEvents.
+ */
+typedef struct IdleJobNode {
+   struct Node node;
+   IDCMPIdleJob job;
+   APTR data;
+} IdleJobNode;
+
+/**
+ * A frame's worth of input gathered by `PollIDCMPEvents`, stored as one
+ * array per field so a tight loop over, say, every Class touches as little
+ * memory as possible. Entry `n` of each array describes the same message.
+ * IAddress is the message's IAddress, for example the gadget of a gadget
+ * class, except for IDCMP_IDCMPUPDATE where the tag list has already been
+ * freed and it is NULL.
+ */
+typedef struct IDCMPPollBatch {
+   ULONG Count;
+   ULONG Class[IDCMP_POLL_CAPACITY];
+   UWORD Code[IDCMP_POLL_CAPACITY];
+   UWORD Qualifier[IDCMP_POLL_CAPACITY];
+   WORD MouseX[IDCMP_POLL_CAPACITY];
+   WORD MouseY[IDCMP_POLL_CAPACITY];
+   ULONG Seconds[IDCMP_POLL_CAPACITY];
+   ULONG Micros[IDCMP_POLL_CAPACITY];
+   APTR IAddress[IDCMP_POLL_CAPACITY];
+} IDCMPPollBatch;
+
+/* What a flight recorder entry describes */
+typedef enum IDCMPFlightKind {
+   FLIGHT_DISPATCH = 1,
+   FLIGHT_WAIT = 2,
+   FLIGHT_WAKE = 3,
+   FLIGHT_WATCHDOG = 4
+} IDCMPFlightKind;
+
+/* The State of a FLIGHT_DISPATCH entry whose handler has not yet returned */
+#define IDCMP_FLIGHT_RUNNING (-1)
+
+/**
+ * One entry of the flight recorder. For FLIGHT_DISPATCH, Class, Code and
+ * the timestamp are the message's, Handler is the handler it was routed
+ * to, or NULL if there was none, and Depth is the number of messages
+ * drained so far by the same call to `ProcessIDCMPMessage`. The entry is
+ * written before the handler is called and its State is
+ * IDCMP_FLIGHT_RUNNING until it returns, so a dump taken while a handler
+ * hangs names the handler. For FLIGHT_WAIT
+ * and FLIGHT_WAKE, Class holds the signals waited for or received and the
+ * timestamp is taken just before or after `Wait`. For FLIGHT_WATCHDOG,
+ * Class holds the microseconds the tripping wakeup took.
+ */
+typedef struct IDCMPFlightRecord {
+   ULONG Class;
+   APTR Handler;
+   ULONG Seconds;
+   ULONG Micros;
+   UWORD Code;
+   UWORD Depth;
+   UBYTE Kind;
+   BYTE State;
+} IDCMPFlightRecord;
+
+/*
+ * A printf style routine the flight recorder is written with when no file
+ * is given; debug.lib's `KPrintF`, for the serial port, is the usual one.
+ * The library never calls `KPrintF` itself, so only programs that pass it
+ * need debug.lib.
+ */
+typedef VOID (*IDCMPFlightPrinter)(CONST_STRPTR format, ...);
+
+/* An event waiting in the queue filled by `PostIDCMPEvent` */
+typedef struct IDCMPPostedEvent {
+   ULONG Class;
+   APTR IAddress;
+   ULONG Seconds;
+   ULONG Micros;
+   UWORD Code;
+   UWORD Qualifier;
+} IDCMPPostedEvent;
+
+/**
+ * A ValueHandler receives the changing value of a gadget registered with
+ * `AddGadgetValueStream`, but only when the value has actually changed and
+ * no more often than the stream's interval allows.
+ * 
+ * @param gadget the gadget whose value changed
+ * @param window the window the gadget belongs to
+ * @param message the message that carried, or prompted, the new value
+ * @param value the gadget's current value
+ * @param final TRUE for the delivery made on IDCMP_GADGETUP, which always
+ * happens regardless of the interval or whether the value changed
+ * @return TRUE if this should terminate the event loop, FALSE if not.
+ */
+typedef BOOL (*IDCMPValueHandler)(
+   IDCMPGadget *gadget,
+   IDCMPWindow *window,
+   IDCMPMessage *message,
+   LONG value,
+   BOOL final
+);
+
+/**
+ * A ValueReader extracts a gadget's current value for a value stream. The
+ * default reader takes the first attribute other than GA_ID from an
+ * IDCMP_IDCMPUPDATE, the pot of the free axis of a proportional gadget or
+ * otherwise the Code of a message addressed to the gadget, as GadTools
+ * sliders and scrollers send their level that way.
+ * 
+ * @param gadget the gadget to read
+ * @param message the message being dispatched
+ * @param value where to store the value
+ * @return TRUE if a value was read, FALSE if the message says nothing about
+ * the gadget's value
+ */
+typedef BOOL (*IDCMPValueReader)(
+   IDCMPGadget *gadget,
+   IDCMPMessage *message,
+   LONG *value
+);
+
+/* Private extension of GadgetEventNode used for value streams */
+struct GadgetValueStream;
+
+/**
+ * A VerifyHandler is invoked for IDCMP_MENUVERIFY, IDCMP_SIZEVERIFY and
+ * IDCMP_REQVERIFY messages while Intuition is still waiting on the reply.
+ * It must be fast; it should only decide how to answer and leave any real
+ * work to the regular MenuVerify, SizeVerify or ReqVerify handlers which
+ * are dispatched ahead of every other message in the same batch.
+ *
+ * @param window the window the verify message was sent to
+ * @param message the live, not yet replied, IntuiMessage
+ * @return VERIFY_ALLOW to let Intuition proceed, VERIFY_CANCEL to cancel a
+ * menu operation (only meaningful for MENUVERIFY with a Code of MENUHOT) or
+ * VERIFY_DEFER to hold the message until `ReplyIDCMPVerify` is called
+ */
+typedef IDCMPVerifyAnswer (*IDCMPVerifyHandler)(
+   IDCMPWindow *window,
+   IDCMPMessage *message
+);
+
+/**
+ * A LoadShedHandler is notified whenever the load shedding policy strips
+ * classes from, or restores classes to, the window's IDCMP flags.
+ *
+ * @param window the window whose IDCMP flags were modified
+ * @param classes the classes that were removed or put back
+ * @param shedding TRUE when the classes were just removed, FALSE when they
+ * have been restored
+ */
+typedef void (*IDCMPLoadShedHandler)(
+   IDCMPWindow *window,
+   ULONG classes,
+   BOOL shedding
+);
+
+/**
+ * The IDCMPHandlers structure contains each of the various IDCMP events that
  * one might listen for by providing a function pointer that can be assigned
- * to code in your project for a given window.
+ * to code in your project.
  * 
  * When an appropriate message comes through, the message and window pointers
- * are passed to the function pointer assigned to this instance of IDCMPEvents
+ * are passed to the function pointer in the handler table of the window's
+ * IDCMPEvents instance. A table holds no per-window state, so a single one
+ * may be shared by any number of windows and may be declared `static const`.
  * 
  * It is worth noting that some event function pointers, receive additional
  * parameters when they are invoked such as mouse coordinates or references to
  * the gadgets they service and so on.
  */
-typedef struct IDCMPEvents {
-   struct List *GadgetEvents;
-
-	IDCMPState (*ActiveWindow)(IDCMPWindow *window, IDCMPMessage *message);
+typedef struct IDCMPHandlers {
+   IDCMPState (*ActiveWindow)(IDCMPWindow *window, IDCMPMessage *message);
    IDCMPState (*ChangeWindow)(IDCMPWindow *window, IDCMPMessage *message);
    IDCMPState (*DismissWindow)(IDCMPWindow *window, IDCMPMessage *message);
    IDCMPState (*DeltaMove)(IDCMPWindow *window, IDCMPMessage *message);
@@ -160,33 +542,202 @@ typedef struct IDCMPEvents {
     IDCMPState (*SizeVerify)(IDCMPWindow *window, IDCMPMessage *message);
     IDCMPState (*VanillaKey)(IDCMPWindow *window, IDCMPMessage *message);
     IDCMPState (*WorkbenchMessage)(IDCMPWindow *window, IDCMPMessage *message);
+
+   /* Fast path answer for verify classes; VerifyDefault is used if NULL */
+   IDCMPVerifyHandler VerifyFast;
+   IDCMPVerifyAnswer VerifyDefault;
+
+   /* Told when the load shedding policy strips or restores classes */
+   IDCMPLoadShedHandler LoadShed;
+
+   /* Receives IDCMP_APPEVENT events posted with PostIDCMPEvent */
+   IDCMPState (*AppEvent)(IDCMPWindow *window, IDCMPMessage *message);
+} IDCMPHandlers;
+
+/**
+ * A handler set is everything that decides how a window's messages are
+ * dispatched: the handler table, the gadget handlers with their hit-test
+ * index, the IDCMP_IDCMPUPDATE routes and the IDCMP flags. While a set is
+ * pushed with `PushIDCMPHandlers` its contents are exchanged with the
+ * window's, so the set holds what it replaced until `PopIDCMPHandlers`
+ * exchanges them back. Gadget handlers added while a set is pushed stay
+ * with the set, ready for the next time it is pushed. Treat the fields as
+ * private; use `InitIDCMPHandlerSet` to prepare one.
+ */
+typedef struct IDCMPHandlerSet {
+   struct IDCMPHandlerSet *Previous;
+   BOOL Pushed;
+
+   const IDCMPHandlers *Handlers;
+   ULONG IDCMPFlags;
+   ULONG RestoreFlags;
+   struct List GadgetEvents;
+   struct IDCMPHitGrid *HitGrid;
+   IDCMPWindow *HitWindow;
+   IDCMPUpdateHandler *UpdateRoutes;
+   ULONG UpdateRouteCount;
+   struct GadgetValueStream *ActiveStream;
+   UWORD ValueStreams;
+
+   /* Nodes retired in GadgetEvents still wait to be freed */
+   BOOL GadgetSweep;
+
+   /* The events whose gadget walk was running when the set was popped */
+   struct IDCMPEvents *Walked;
+   struct IDCMPHandlerSet *NextWalked;
+} IDCMPHandlerSet;
+
+/* Private; a batch of drained messages awaiting dispatch */
+struct IDCMPBatch;
+
+/**
+ * The IDCMPEvents structure is the small, mutable, per-window instance
+ * handed to `HandleIDCMP` and friends. It points at a shared, read only
+ * `IDCMPHandlers` table and embeds the list of gadget handlers along with
+ * whatever state the event loop keeps for the window. UserData belongs to
+ * the application; handlers can reach it via `GetIDCMPUserData`.
+ */
+typedef struct IDCMPEvents {
+   const IDCMPHandlers *Handlers;
+   struct List GadgetEvents;
+   APTR UserData;
+
+   /* A verify message held by VERIFY_DEFER until ReplyIDCMPVerify */
+   IDCMPMessage *DeferredVerify;
+
+   /* Largest observed verify send-to-reply latency, in microseconds */
+   ULONG VerifyMaxLatency;
+
+   /* The last UserPort message already searched for verify classes */
+   struct Node *VerifyScanned;
+
+   /* Messages drained by the most recent call to ProcessIDCMPMessage */
+   ULONG QueueDepth;
+
+   /* Drained copies, kept until dispatched; allocated on first use */
+   struct IDCMPBatch *Batches;
+
+   /*
+    * Classes dispatched in the bulk lane, after all others in a batch;
+    * 0 by default, keeping arrival order, or BULK_IDCMP_EVENTS
+    */
+   ULONG BulkClasses;
+
+   /* Load shedding policy and state; see SetIDCMPLoadShedding */
+   ULONG ShedClasses;
+   ULONG ShedActive;
+   UWORD ShedHighWater;
+   UWORD ShedLowWater;
+   UWORD ShedRestoreWakeups;
+   UWORD ShedCalmWakeups;
+
+   /* Gadget hit-test index, its window and the node under the pointer */
+   struct IDCMPHitGrid *HitGrid;
+   IDCMPWindow *HitWindow;
+   GadgetEventNode *Hover;
+
+   /*
+    * Nesting depth of walks over GadgetEvents; while non-zero, removals
+    * only retire nodes and GadgetSweep asks for them to be freed later
+    */
+   UWORD GadgetWalkers;
+   BOOL GadgetSweep;
+
+   /* IDCMP_IDCMPUPDATE handlers indexed directly by GA_ID */
+   IDCMPUpdateHandler *UpdateRoutes;
+   ULONG UpdateRouteCount;
+
+   /* Value streams registered and the one whose gadget is being dragged */
+   struct GadgetValueStream *ActiveStream;
+   UWORD ValueStreams;
+
+   /* The most recently pushed handler set, linked through Previous */
+   IDCMPHandlerSet *HandlerSets;
+
+   /* Sets popped during the current gadget walk, linked by NextWalked */
+   IDCMPHandlerSet *WalkedSets;
+
+   /* Background jobs run round robin while the UserPort is empty */
+   struct List IdleJobs;
+   IdleJobNode *IdleRunning;
+   BOOL IdleCancelled;
+   ULONG IdleBudget;
+
+   /*
+    * Ring of recent dispatch decisions, NULL should memory have run out;
+    * FlightCount is the number of entries ever written, so the newest is
+    * at (FlightCount - 1) & (IDCMP_FLIGHT_RECORDS - 1)
+    */
+   IDCMPFlightRecord *FlightLog;
+   ULONG FlightCount;
+   IDCMPFlightPrinter FlightPrinter;
+
+   /* Dump the recorder to WatchdogFile when a wakeup takes this long */
+   ULONG WatchdogMicros;
+   BPTR WatchdogFile;
+   ULONG WatchdogTrips;
+
+   /*
+    * Events posted by the application, read from PostHead and written at
+    * PostTail, the task owning the window and, if other tasks post, the
+    * signal that wakes it; all set up by EnableIDCMPPosting
+    */
+   IDCMPPostedEvent *Posted;
+   UWORD PostHead;
+   UWORD PostTail;
+   struct Task *PostTask;
+   ULONG PostSignal;
+   BYTE PostSigBit;
 } IDCMPEvents;
 
+/**
+ * A handler table with only `DismissWindow` filled in, closing the window
+ * and finishing the message loop. Copy it to start a table of your own.
+ */
+extern const IDCMPHandlers IDCMPBasicHandlers;
+
 /**
  * Given a pointer to a `IDCMPEvents` structure, this method will, at the very
  * least, zero all the values within. This makes it easy and safe to use the 
- * structure with partially filled out method invocations. It will also 
- * allocate and intilize the exec list of gadgets for use with gadget handler
- * functions.
+ * structure before a handler table has been assigned. It will also 
+ * initialize the embedded exec list of gadgets for use with gadget handler
+ * functions and allocate the flight recorder's ring. The first
+ * `ProcessIDCMPMessage` allocates a batch as well, so every initialized
+ * instance must be released with `FreeIDCMPEvents`.
  * 
  * @param events a pointer to a `IDCMPEvents` structure
  */
 void InitializeIDCMPEvents(IDCMPEvents *events);
 
 /**
- * Frees the memory allocated for the gadget list and the IDCMPEvents object
- * itself, should the `freeOnlyContents` boolean value be `FALSE`.
+ * Allocates and initializes an `IDCMPEvents` instance, pointing it at the
+ * supplied handler table. Release it with `FreeIDCMPEvents(events, FALSE)`.
+ * 
+ * @param handlers the, possibly shared, handler table to use
+ * @param userData application data made available to the handlers
+ * @returns the new instance or NULL if memory ran out
+ */
+IDCMPEvents *AllocIDCMPEvents(const IDCMPHandlers *handlers, APTR userData);
+
+/**
+ * Frees the memory allocated for the gadget handlers, batches, flight
+ * recorder and any indexes kept by the IDCMPEvents object, and the object
+ * itself should the
+ * `freeOnlyContents` boolean value be `FALSE`. A verify message still held
+ * by VERIFY_DEFER is answered with VERIFY_ALLOW first.
  * 
  * @param events a pointer to a `struct IDCMPEvents` object
- * @param freeOnlyContents a boolena value that when false, will cause not
- * only the list of Gadgets in the structure be released but also the events
- * object itself.
+ * @param freeOnlyContents a boolean value that when false, will cause not
+ * only the contents to be released but also the events object itself, which
+ * must then have come from `AllocIDCMPEvents`.
  */
 void FreeIDCMPEvents(IDCMPEvents *events, BOOL freeOnlyContents);
 
 /**
  * For those folks not wanting to write their own dismiss window handler, this
- * method will apply a basic one that terminates the active message loop.
+ * method will point an events instance without a handler table at
+ * `IDCMPBasicHandlers`, which terminates the active message loop when the
+ * close gadget is clicked.
  * 
  * @param events a pointer to a `IDCMPEvents` structure
  */
@@ -198,30 +749,169 @@ void ApplyIDCMPBasics(IDCMPEvents *events);
  * all the desired handlers and a pointer to a `Window` structure to know 
  * which window we are working on.
  * 
+ * Messages are drained from the UserPort in batches of up to
+ * `IDCMP_BATCH_SIZE`; each one is copied and replied immediately, verify
+ * classes first being answered through `VerifyFast`. The copies are then
+ * dispatched in priority lanes; verify classes ahead of everything else,
+ * then all but the events' `BulkClasses`, then those. Handlers always
+ * receive a pointer to the copy rather than the replied original. No class
+ * handlers are called for an events instance without a handler table.
+ * 
+ * The copies are kept with the events, not on the stack. When a handler
+ * finishes the loop, the rest of the batch stays queued and is dispatched
+ * first by the next call, just as unread messages would have stayed on the
+ * UserPort. A handler may run a nested loop on the same events, say for a
+ * modal requester; it carries on with the batch the handler was called
+ * from before draining any more.
+ * 
  * @param events a pointer to a `IDCMPEvents` structure containing all the
  * handlers for use when working with Intuition windows
  * @param window a pointer to a `Window` structure for which the IDCMP events 
  * pertain to
- * @param intialDone a TRUE or FALSE value that denotes the number of times
- * the messages will be 
+ * @returns STATE_FINISHED as soon as any handler returns it, otherwise the
+ * last state other than STATE_NO_CHANGE returned by a handler, or
+ * STATE_NO_CHANGE if there was none
  */
 IDCMPState ProcessIDCMPMessage(IDCMPEvents *events, IDCMPWindow *window);
 
+/**
+ * A non-blocking alternative to `HandleIDCMP` for programs, such as games,
+ * that want to pull all pending input once per frame rather than receive
+ * it through handlers. Messages are taken from the UserPort, replied right
+ * away and copied into the caller's batch; nothing is allocated and no
+ * handlers are dispatched. Verify classes are still answered through the
+ * handler table's `VerifyFast` handler or `VerifyDefault` policy. Events
+ * queued with `PostIDCMPEvent` follow the UserPort's messages.
+ * 
+ * @param events the `IDCMPEvents` structure for the window
+ * @param window the window whose UserPort should be drained
+ * @param batch the caller supplied storage to fill; its Count is set to the
+ * number of messages returned
+ * @param max the most messages to take; anything beyond
+ * `IDCMP_POLL_CAPACITY` is clamped
+ * @returns the number of messages copied into the batch; if this equals
+ * `max` more may still be waiting
+ */
+ULONG PollIDCMPEvents(
+   IDCMPEvents *events,
+   IDCMPWindow *window,
+   IDCMPPollBatch *batch,
+   ULONG max
+);
+
+/**
+ * Returns the `IDCMPEvents` instance a message is being dispatched for.
+ * This works for the message passed to any handler in an `IDCMPHandlers`
+ * table or to a gadget handler, as those always receive the library's own
+ * copy of the message, but not for the live message given to `VerifyFast`.
+ * 
+ * @param message the message passed to the handler
+ * @returns the events instance the handler was invoked for
+ */
+IDCMPEvents *GetIDCMPEvents(IDCMPMessage *message);
+
+/**
+ * A shorthand for `GetIDCMPEvents(message)->UserData`.
+ * 
+ * @param message the message passed to the handler
+ * @returns the application's UserData for the window
+ */
+APTR GetIDCMPUserData(IDCMPMessage *message);
+
+/**
+ * Answers a verify message that was held back when the handler table's
+ * `VerifyFast` handler, or `VerifyDefault` policy, returned VERIFY_DEFER.
+ * Intuition remains frozen until this is called so it should happen
+ * promptly and always before the window is closed; the close handler of
+ * `IDCMPBasicHandlers` and `FreeIDCMPEvents` allow any verify still
+ * deferred. Calling this with nothing deferred is a harmless no-op.
+ *
+ * @param events the `IDCMPEvents` structure holding the deferred message
+ * @param answer VERIFY_ALLOW or VERIFY_CANCEL; VERIFY_DEFER is treated as
+ * VERIFY_ALLOW
+ */
+void ReplyIDCMPVerify(IDCMPEvents *events, IDCMPVerifyAnswer answer);
+
+/**
+ * Configures the overload policy used by `HandleIDCMP`. After every wakeup
+ * the number of messages that were waiting on the UserPort is compared to
+ * `highWater`; once it is reached the `classes` the window currently
+ * receives are removed with a single `ModifyIDCMP` call. They are put back
+ * only after `restoreWakeups` consecutive wakeups found no more than
+ * `lowWater` messages waiting. The handler table's `LoadShed` handler, if
+ * any, is told of both transitions.
+ *
+ * Passing a `highWater` of 0 disables the policy and immediately restores
+ * any classes that are still shed. Do so before closing the window yourself
+ * if the loop may have ended while shedding.
+ *
+ * @param events the `IDCMPEvents` structure to configure
+ * @param window the window whose IDCMP flags are managed
+ * @param classes the classes that may be shed; SHEDDABLE_IDCMP_EVENTS is a
+ * sensible choice
+ * @param highWater queue depth at which shedding starts, 0 to disable
+ * @param lowWater queue depth at or below which a wakeup counts as calm
+ * @param restoreWakeups calm wakeups required before restoring
+ */
+void SetIDCMPLoadShedding(
+   IDCMPEvents *events,
+   IDCMPWindow *window,
+   ULONG classes,
+   UWORD highWater,
+   UWORD lowWater,
+   UWORD restoreWakeups
+);
+
+/**
+ * Queues a job to be run in time budgeted slices by `HandleIDCMP` whenever
+ * no messages are pending. Jobs take turns one slice at a time and the
+ * UserPort is checked between every slice. When no jobs remain the loop
+ * goes back to sleeping in `Wait()`.
+ * 
+ * @param events the `IDCMPEvents` structure to queue the job on
+ * @param job the function performing the work
+ * @param data passed through to the job on every call
+ * @returns TRUE if the job was queued; FALSE if memory ran out
+ */
+BOOL AddIdleJob(IDCMPEvents *events, IDCMPIdleJob job, APTR data);
+
+/**
+ * Removes every queued idle job matching both the job function and data
+ * pointer. This may be called from within a running job, including to
+ * remove itself.
+ * 
+ * @param events the `IDCMPEvents` structure holding the job
+ * @param job the function the job was queued with
+ * @param data the data pointer the job was queued with
+ */
+void RemoveIdleJob(IDCMPEvents *events, IDCMPIdleJob job, APTR data);
+
+/**
+ * Reports whether an idle job has used up the budget of its slice.
+ * 
+ * @param slice the slice passed to the idle job
+ * @returns TRUE once the job should return
+ */
+BOOL IdleSliceExpired(IDCMPIdleSlice *slice);
+
 /**
  * This function performs the `Wait` calls on the `UserPort`'s `mp_SigBit`
- * property. It does so as long as each call to `ProcessIDCMPMessage` 
- * returns `TRUE`. To perform the work at hand, three values are required
- * from the invoking user; a pointer to a `IDCMPEvents` structure that 
- * contains all the function handlers for the various types of events, a
- * pointer to a `Window` structure that refer to the window being handled
- * and an initial `BOOL` value to determine the starting `done` state. If 
- * the initial done state is TRUE, indicating the loop is done then loop 
- * will process only once; unless some handler returns FALSE explicitly
+ * property, passing each wakeup to `ProcessIDCMPMessage`, until a handler
+ * returns STATE_FINISHED. While idle jobs are queued it runs them instead
+ * of sleeping, one slice at a time, for as long as no signal is pending.
+ * To perform the work at hand, three values are required from the
+ * invoking user; a pointer to a `IDCMPEvents` structure that points at
+ * the handlers for the various types of events, a pointer to a `Window`
+ * structure that refer to the window being handled and an initial
+ * `IDCMPState` to determine the starting `done` state. If the initial
+ * state is STATE_FINISHED the loop will process a single wakeup, unless
+ * some handler returns STATE_CONTINUE explicitly.
  * 
  * @param events pointer to the `IDCMPEvents` structure with which to work
  * @param window pointer to the `Window` structure with which to work
- * @param initialDone TRUE if the loop should wait and run only once; FALSE
- * if the loop should run until a handler returns TRUE.
+ * @param initialDone STATE_FINISHED if the loop should wait and run only
+ * once; STATE_CONTINUE if it should run until a handler returns
+ * STATE_FINISHED.
  */
 void HandleIDCMP(
    IDCMPEvents *events, 
@@ -230,8 +920,89 @@ void HandleIDCMP(
 );
 
 /**
- * A convenience function that walks the Exec list for gadget handlers and
+ * Prepares a window's IDCMPEvents for `PostIDCMPEvent`, allocating its
+ * queue of IDCMP_POST_CAPACITY events. Call it from the task that runs
+ * `HandleIDCMP` or `PollIDCMPEvents` for the window. Only that task may
+ * post unless `otherTasks` is TRUE, which also allocates a signal for
+ * other tasks to wake it with. It may be called again to add the signal
+ * later; `FreeIDCMPEvents` frees both.
+ * 
+ * @param events the IDCMPEvents that should accept posted events
+ * @param otherTasks TRUE if tasks other than the caller will post
+ * @returns TRUE if posting is enabled; FALSE if the queue or the signal
+ * could not be allocated
+ */
+BOOL EnableIDCMPPosting(IDCMPEvents *events, BOOL otherTasks);
+
+/**
+ * Queues an event for the window without going through Intuition, to be
+ * copied into the same batch as the UserPort's messages by the next
+ * `ProcessIDCMPMessage` and dispatched through the same handler table,
+ * or returned by the next `PollIDCMPEvents` after the UserPort's messages.
+ * Use IDCMP_APPEVENT for the application's own events, or any Intuition
+ * class to replay input. Nothing is allocated or replied; the queue comes
+ * from `EnableIDCMPPosting`, and other tasks may only post if it was asked
+ * for a signal to wake `HandleIDCMP` with.
+ * 
+ * @param events the IDCMPEvents whose window should receive the event
+ * @param class the event's class, IDCMP_APPEVENT or an IDCMP class
+ * @param code the event's Code
+ * @param qualifier the event's Qualifier
+ * @param iAddress the event's IAddress; for IDCMP_IDCMPUPDATE a tag list
+ * that must remain valid until the event has been dispatched
+ * @returns TRUE if the event was queued; FALSE if the queue is full,
+ * posting was not enabled or another task posted without a signal
+ */
+BOOL PostIDCMPEvent(
+   IDCMPEvents *events,
+   ULONG class,
+   UWORD code,
+   UWORD qualifier,
+   APTR iAddress
+);
+
+/**
+ * Writes the flight recorder's entries, oldest first, one per line. The
+ * recorder is always running, so this can be called at any time, from a
+ * handler or a debugging hotkey for instance.
+ * 
+ * @param events the IDCMPEvents whose recorder should be written
+ * @param file an open AmigaDOS file, or NULL to write with the printer set
+ * by `SetIDCMPFlightPrinter`; nothing is written if there is neither
+ */
+void DumpIDCMPFlightRecorder(IDCMPEvents *events, BPTR file);
+
+/**
+ * Sets the routine the flight recorder is written with when no file is
+ * given, typically `SetIDCMPFlightPrinter(events, KPrintF)` to reach the
+ * serial port, in which case the program links with debug.lib.
+ * 
+ * @param events the IDCMPEvents whose recorder will be written
+ * @param printer a printf style routine, or NULL for none
+ */
+void SetIDCMPFlightPrinter(IDCMPEvents *events, IDCMPFlightPrinter printer);
+
+/**
+ * Arms a watchdog in `HandleIDCMP`: whenever handling a single wakeup
+ * takes longer than `micros`, a FLIGHT_WATCHDOG entry is recorded, 
+ * WatchdogTrips is incremented and the recorder is dumped to `file`.
+ * 
+ * The check is made once the wakeup has been handled, so this detects
+ * slow wakeups; a handler that never returns cannot trip it. To look into
+ * a hang, call `DumpIDCMPFlightRecorder` from another task, a commodity's
+ * hotkey say, and look for the entry still marked IDCMP_FLIGHT_RUNNING.
  * 
+ * @param events the IDCMPEvents to watch
+ * @param micros the longest acceptable wakeup, or 0 to disarm
+ * @param file where to dump the recorder, or NULL for the printer set by
+ * `SetIDCMPFlightPrinter`
+ */
+void SetIDCMPWatchdog(IDCMPEvents *events, ULONG micros, BPTR file);
+
+/**
+ * A convenience function that walks the Exec list for gadget handlers and
+ * invokes the `Looper` for each one. The `Looper` may remove handlers; any
+ * removed nodes are skipped and freed once the walk completes.
  */
 void ForEachGadget(
    IDCMPEvents *events, 
@@ -256,9 +1027,74 @@ void AddGadgetHandler(
    GadgetEventType type
 );
 
+/**
+ * Registers handlers for an array of gadgets using a single allocation for
+ * all of their nodes. Entries with a NULL gadget or handler are skipped.
+ * 
+ * @param events the IDCMPEvents object to add the handlers to
+ * @param bindings an array of gadget, handler and type entries
+ * @param count the number of entries in the array
+ * @returns the number of handlers registered; 0 if memory ran out
+ */
+ULONG AddGadgetHandlers(
+   IDCMPEvents *events,
+   const GadgetHandlerBinding *bindings,
+   ULONG count
+);
+
+/**
+ * Registers the same handler for every gadget in a chain linked through
+ * `NextGadget`, such as the list built by GadTools' `CreateGadget()`, using
+ * a single allocation for all of the nodes.
+ * 
+ * @param events the IDCMPEvents object to add the handlers to
+ * @param gadgets the first gadget in the chain
+ * @param handler the function pointer to invoke for each of the gadgets
+ * @param type some combination of GADGET_UP, GADGET_DOWN and GADGET_HELP
+ * @returns the number of handlers registered; 0 if memory ran out
+ */
+ULONG AddGadgetChainHandlers(
+   IDCMPEvents *events,
+   IDCMPGadget *gadgets,
+   IDCMPGadgetHandler handler,
+   GadgetEventType type
+);
+
+/**
+ * Registers a value stream for a proportional, slider, scroller or BOOPSI
+ * gadget. While the gadget is being dragged its value is read from each
+ * IDCMP_GADGETDOWN, IDCMP_MOUSEMOVE, IDCMP_INTUITICKS and, matched by
+ * GA_ID, IDCMP_IDCMPUPDATE message, and the handler is called only when
+ * the value differs from the last one delivered, at most once every
+ * `interval` milliseconds. A change held back by the interval is delivered
+ * by a later message, and IDCMP_GADGETUP always delivers the final value,
+ * so the gadget needs GACT_RELVERIFY (GA_RelVerify for BOOPSI).
+ * 
+ * The stream is an ordinary gadget handler node of type GADGET_DOWN,
+ * GADGET_UP and GADGET_VALUE; remove it with `RemoveGadgetHandlersForId` or
+ * `RemoveGadgetHandlersByType(events, GADGET_VALUE)`.
+ * 
+ * @param events the IDCMPEvents object to add the stream to
+ * @param gadget the gadget to follow
+ * @param handler the function to call with each new value
+ * @param reader a function to read the value, or NULL for the default
+ * @param interval the minimum number of milliseconds between deliveries
+ * @returns TRUE if the stream was registered; FALSE if memory ran out
+ */
+BOOL AddGadgetValueStream(
+   IDCMPEvents *events,
+   IDCMPGadget *gadget,
+   IDCMPValueHandler handler,
+   IDCMPValueReader reader,
+   UWORD interval
+);
+
 /**
  * This function will remove all gadget handlers installed, that match the
- * types specified from the supplied events list.
+ * types specified from the supplied events list. The list is swept once;
+ * it is safe to call from within a gadget handler or `ForEachGadget`, in
+ * which case the nodes are retired immediately but only freed once the
+ * walk has finished.
  * 
  * @param events IDCMPEvents object to remove the handlers from
  * @param type some combination of GADGET_UP, GADGET_DOWN and GADGET_HELP
@@ -270,7 +1106,9 @@ void RemoveGadgetHandlersByType(
 
 /**
  * This function will remove all gadget handlers installed, that match the
- * GadgetId specified from the supplied events list.
+ * GadgetId specified from the supplied events list. Like
+ * `RemoveGadgetHandlersByType` it is a single sweep that is safe to use
+ * while the list is being walked.
  * 
  * @param events IDCMPEvents object to remove the handlers from
  * @param GadgetId the GadgetId property of the Gadget that matches the 
@@ -281,6 +1119,52 @@ void RemoveGadgetHandlersForId(
    UWORD GadgetId
 );
 
+/**
+ * Routes IDCMP_IDCMPUPDATE messages from the BOOPSI object with the given
+ * GA_ID to a dedicated handler. Routes are kept in a table indexed by the
+ * id itself, so ids should be small and dense; the table at least doubles
+ * whenever it must grow to fit a larger id. Messages without a route, or
+ * without a GA_ID, still go to the `IdcmpUpdate` handler.
+ * 
+ * @param events the `IDCMPEvents` structure to add the route to
+ * @param gadgetId the GA_ID of the object
+ * @param handler the handler to invoke, or NULL to remove the route
+ * @returns TRUE if the route was stored; FALSE if memory ran out
+ */
+BOOL SetIDCMPUpdateRoute(
+   IDCMPEvents *events,
+   UWORD gadgetId,
+   IDCMPUpdateHandler handler
+);
+
+/**
+ * Builds a uniform grid index over the geometry of every registered gadget
+ * handler so that the gadget under a point can be found without walking
+ * the handler list. Once enabled, `AddGadgetHandler` adds new gadgets to
+ * the index, `IDCMP_NEWSIZE` re-indexes only the gadgets with relative
+ * geometry, and every `IDCMP_MOUSEMOVE` delivers GADGET_ENTER and
+ * GADGET_LEAVE to the handlers registered for those types. Calling this
+ * again rebuilds the index from scratch.
+ * 
+ * @param events the `IDCMPEvents` structure holding the gadget handlers
+ * @param window the window the gadgets are attached to
+ * @returns TRUE if the index was built; FALSE if memory ran out
+ */
+BOOL EnableGadgetHitTest(IDCMPEvents *events, IDCMPWindow *window);
+
+/**
+ * Finds the registered gadget handler node whose gadget covers the given
+ * window relative point, using the index built by `EnableGadgetHitTest`.
+ * Where gadgets overlap the most recently indexed one wins.
+ * 
+ * @param events the `IDCMPEvents` structure to search
+ * @param x the window relative horizontal position, e.g. `window->MouseX`
+ * @param y the window relative vertical position, e.g. `window->MouseY`
+ * @returns the matching GadgetEventNode or NULL if there is none or if the
+ * index is not enabled
+ */
+GadgetEventNode *HitTestGadget(IDCMPEvents *events, WORD x, WORD y);
+
 /**
  * Looks through a given IDCMPEvents structure for a registered GadgetEventNode
  * and returns TRUE if one is found. FALSE is returned otherwise. Note that
@@ -352,5 +1236,64 @@ GadgetEventNode *GetGadgetNodeByPtr(IDCMPEvents *events, IDCMPGadget *gadget);
  */
 IDCMPGadget *FindGadgetById(IDCMPEvents *events, UWORD gadgetId);
 
+/**
+ * Prepares a handler set for `PushIDCMPHandlers`. The set starts without
+ * gadget handlers; add them with `AddGadgetHandler` and friends once it
+ * has been pushed and they will be kept with the set from then on.
+ * 
+ * @param set the set to initialize
+ * @param handlers the handler table to use while the set is pushed
+ * @param idcmpFlags the IDCMP flags the window should have while the set is
+ * pushed, or 0 to leave them as they are
+ */
+void InitIDCMPHandlerSet(
+   IDCMPHandlerSet *set,
+   const IDCMPHandlers *handlers,
+   ULONG idcmpFlags
+);
+
+/**
+ * Makes a handler set current, for a modal requester or a wizard panel
+ * say, saving the current one inside the set. This is a constant time
+ * exchange of pointers and list headers and at most one `ModifyIDCMP`
+ * call, unless the window was resized while the incoming hit-test index
+ * was out of use; it is then brought up to date as a NEWSIZE would. Any
+ * load shedding in effect is ended first. It is safe to call from within
+ * a handler.
+ * 
+ * @param events the IDCMPEvents to change
+ * @param window the window whose IDCMP flags should follow the set
+ * @param set the set to push; it must not already be pushed
+ * @returns TRUE if the set was pushed, FALSE if it was already pushed
+ */
+BOOL PushIDCMPHandlers(
+   IDCMPEvents *events, 
+   IDCMPWindow *window, 
+   IDCMPHandlerSet *set
+);
+
+/**
+ * Undoes the most recent `PushIDCMPHandlers`, restoring exactly what was
+ * current before it, IDCMP flags included. The popped set keeps its own
+ * gadget handlers, hit-test index and routes for the next push.
+ * 
+ * @param events the IDCMPEvents to change
+ * @param window the window whose IDCMP flags should be restored, or NULL
+ * if the window has already been closed
+ * @returns the set that was popped, or NULL if none was pushed
+ */
+IDCMPHandlerSet *PopIDCMPHandlers(IDCMPEvents *events, IDCMPWindow *window);
+
+/**
+ * Frees the gadget handlers, hit-test index and routes held by a set that
+ * is not currently pushed; the set itself belongs to the caller. 
+ * `FreeIDCMPEvents` pops any sets still pushed, so call this afterwards.
+ * A set popped by a gadget handler may be freed by that handler too; its
+ * gadget handlers are then retired and freed once the walk has finished.
+ * 
+ * @param set the set whose contents should be freed
+ */
+void FreeIDCMPHandlerSet(IDCMPHandlerSet *set);
+
 
 #endif
\ No newline at end of file
@@ -5,13 +5,502 @@
 #include <clib/exec_protos.h>
 #include <clib/intuition_protos.h>
 #include <clib/alib_protos.h>
+#include <clib/dos_protos.h>
+#include <intuition/gadgetclass.h>
 #include <string.h>
 
 #include <intuition/idcmp.h>
 
+/* Marks an empty cell or the end of a cell's chain of hit entries */
+#define IDCMP_HIT_NONE 0xFFFF
+
+#define IDCMP_RELATIVE_GADGET (\
+   GFLG_RELRIGHT | GFLG_RELBOTTOM | GFLG_RELWIDTH | GFLG_RELHEIGHT)
+
+/* Routes the update table starts with; it doubles as higher ids arrive */
+#define IDCMP_UPDATE_MIN_ROUTES 16
+
+typedef struct IDCMPHitEntry {
+   GadgetEventNode *node;
+   UWORD next;
+} IDCMPHitEntry;
+
+/*
+ * Every cell holds the index of the first of a chain of entries, one entry
+ * per gadget overlapping that cell. Entries live in a single pool that is
+ * grown by doubling; released entries are chained onto freeEntry.
+ */
+struct IDCMPHitGrid {
+   WORD width;
+   WORD height;
+   UWORD columns;
+   UWORD rows;
+   UWORD capacity;
+   UWORD freeEntry;
+   IDCMPHitEntry *entries;
+   UWORD cells[1];
+};
+
+/**
+ * Calculates the window relative rectangle covered by a gadget, taking
+ * relative positioning and GimmeZeroZero inner gadgets into account.
+ */
+static void
+__idcmp_gadget_bounds__(
+   struct Window *window, 
+   struct Gadget *gadget, 
+   struct Rectangle *bounds
+) {
+   BOOL inner = (window->Flags & WFLG_GIMMEZEROZERO) && 
+      !(gadget->GadgetType & GTYP_GZZGADGET);
+   WORD width = inner ? window->GZZWidth : window->Width;
+   WORD height = inner ? window->GZZHeight : window->Height;
+   WORD left = gadget->LeftEdge;
+   WORD top = gadget->TopEdge;
+   WORD right = gadget->Width;
+   WORD bottom = gadget->Height;
+
+   if (gadget->Flags & GFLG_RELRIGHT) { left += width - 1; }
+   if (gadget->Flags & GFLG_RELBOTTOM) { top += height - 1; }
+   if (gadget->Flags & GFLG_RELWIDTH) { right += width; }
+   if (gadget->Flags & GFLG_RELHEIGHT) { bottom += height; }
+
+   if (inner) {
+      left += window->BorderLeft;
+      top += window->BorderTop;
+   }
+
+   bounds->MinX = left;
+   bounds->MinY = top;
+   bounds->MaxX = left + right - 1;
+   bounds->MaxY = top + bottom - 1;
+}
+
+/**
+ * Clips a rectangle to the grid and converts it into an inclusive range
+ * of cell coordinates.
+ *
+ * @returns FALSE if the rectangle does not touch the grid at all
+ */
+static BOOL
+__idcmp_hitgrid_span__(
+   struct IDCMPHitGrid *grid, 
+   struct Rectangle *bounds,
+   struct Rectangle *cells
+) {
+   LONG maxX = ((LONG)grid->columns << IDCMP_HIT_CELL_SHIFT) - 1;
+   LONG maxY = ((LONG)grid->rows << IDCMP_HIT_CELL_SHIFT) - 1;
+
+   if (
+      bounds->MaxX < bounds->MinX || bounds->MaxY < bounds->MinY ||
+      bounds->MaxX < 0 || bounds->MaxY < 0 || 
+      bounds->MinX > maxX || bounds->MinY > maxY
+   ) {
+      return FALSE;
+   }
+
+   cells->MinX = (bounds->MinX < 0 ? 0 : bounds->MinX) >> IDCMP_HIT_CELL_SHIFT;
+   cells->MinY = (bounds->MinY < 0 ? 0 : bounds->MinY) >> IDCMP_HIT_CELL_SHIFT;
+   cells->MaxX = (bounds->MaxX > maxX ? maxX : bounds->MaxX) >> IDCMP_HIT_CELL_SHIFT;
+   cells->MaxY = (bounds->MaxY > maxY ? maxY : bounds->MaxY) >> IDCMP_HIT_CELL_SHIFT;
+
+   return TRUE;
+}
+
+/**
+ * Takes an entry from the free chain, doubling the entry pool when it has
+ * run dry.
+ *
+ * @returns the entry index or IDCMP_HIT_NONE if no memory was available
+ */
+static UWORD
+__idcmp_hitgrid_entry__(struct IDCMPHitGrid *grid) {
+   IDCMPHitEntry *entries;
+   ULONG capacity;
+   UWORD index;
+
+   if (grid->freeEntry == IDCMP_HIT_NONE) {
+      capacity = grid->capacity ? grid->capacity * 2L : 64L;
+      if (capacity > IDCMP_HIT_NONE) {
+         capacity = IDCMP_HIT_NONE;
+      }
+
+      if (capacity <= grid->capacity) {
+         return IDCMP_HIT_NONE;
+      }
+
+      entries = AllocVec(capacity * sizeof(IDCMPHitEntry), MEMF_ANY);
+      if (!entries) {
+         return IDCMP_HIT_NONE;
+      }
+
+      if (grid->entries) {
+         CopyMem(grid->entries, entries, grid->capacity * sizeof(IDCMPHitEntry));
+         FreeVec(grid->entries);
+      }
+
+      for (index = grid->capacity; index < capacity - 1; index++) {
+         entries[index].next = index + 1;
+      }
+      entries[capacity - 1].next = IDCMP_HIT_NONE;
+
+      grid->freeEntry = grid->capacity;
+      grid->capacity = (UWORD)capacity;
+      grid->entries = entries;
+   }
+
+   index = grid->freeEntry;
+   grid->freeEntry = grid->entries[index].next;
+
+   return index;
+}
+
+/**
+ * Records the gadget's current bounds on the node and links the node into
+ * every cell those bounds overlap.
+ */
+static void
+__idcmp_hitgrid_insert__(
+   struct IDCMPHitGrid *grid,
+   struct Window *window,
+   GadgetEventNode *node
+) {
+   struct Rectangle span;
+   UWORD column, row, index, *cell;
+
+   if (!node->gadget) { return; }
+
+   __idcmp_gadget_bounds__(window, node->gadget, &node->bounds);
+
+   if (!__idcmp_hitgrid_span__(grid, &node->bounds, &span)) {
+      return;
+   }
+
+   for (row = span.MinY; row <= span.MaxY; row++) {
+      for (column = span.MinX; column <= span.MaxX; column++) {
+         if (IDCMP_HIT_NONE == (index = __idcmp_hitgrid_entry__(grid))) {
+            return;
+         }
+
+         cell = &grid->cells[row * grid->columns + column];
+         grid->entries[index].node = node;
+         grid->entries[index].next = *cell;
+         *cell = index;
+      }
+   }
+}
+
+/**
+ * Unlinks the node from every cell covered by the bounds it was indexed
+ * with, returning the entries to the free chain.
+ */
+static void
+__idcmp_hitgrid_remove__(struct IDCMPHitGrid *grid, GadgetEventNode *node) {
+   struct Rectangle span;
+   UWORD column, row, index, *link;
+
+   if (!__idcmp_hitgrid_span__(grid, &node->bounds, &span)) {
+      return;
+   }
+
+   for (row = span.MinY; row <= span.MaxY; row++) {
+      for (column = span.MinX; column <= span.MaxX; column++) {
+         link = &grid->cells[row * grid->columns + column];
+
+         while (IDCMP_HIT_NONE != (index = *link)) {
+            if (grid->entries[index].node == node) {
+               *link = grid->entries[index].next;
+               grid->entries[index].next = grid->freeEntry;
+               grid->freeEntry = index;
+            }
+            else {
+               link = &grid->entries[index].next;
+            }
+         }
+      }
+   }
+}
+
+/*
+ * Backing store for nodes registered in bulk; live counts the nodes that
+ * have not yet been freed.
+ */
+struct GadgetEventBlock {
+   ULONG live;
+   GadgetEventNode nodes[1];
+};
+
+/**
+ * Releases a node, or its share of the block it was allocated in.
+ */
+static void
+__idcmp_free_gadget_node__(GadgetEventNode *node) {
+   struct GadgetEventBlock *block = node->block;
+
+   if (!block) {
+      FreeVec(node);
+   }
+   else if (--block->live == 0) {
+      FreeVec(block);
+   }
+}
+
+static void
+__idcmp_hitgrid_free__(struct IDCMPHitGrid *grid) {
+   if (grid) {
+      if (grid->entries) {
+         FreeVec(grid->entries);
+      }
+
+      FreeVec(grid);
+   }
+}
+
+/**
+ * Drops a node from the hit-test index and either unlinks and frees it or,
+ * while the list is being walked, clears its gadget so lookups skip it and
+ * leaves it for `__idcmp_sweep_gadgets__`.
+ */
+static void
+__idcmp_retire_gadget__(IDCMPEvents *events, GadgetEventNode *node) {
+   if (events->Hover == node) {
+      events->Hover = NULL;
+   }
+
+   if (node->type & GADGET_VALUE) {
+      events->ValueStreams--;
+
+      if ((GadgetEventNode *)events->ActiveStream == node) {
+         events->ActiveStream = NULL;
+      }
+   }
+
+   if (events->HitGrid) {
+      __idcmp_hitgrid_remove__(events->HitGrid, node);
+   }
+
+   if (events->GadgetWalkers) {
+      node->gadget = NULL;
+      node->handler = NULL;
+      node->type = 0;
+      events->GadgetSweep = TRUE;
+      return;
+   }
+
+   Remove((struct Node *)node);
+   __idcmp_free_gadget_node__(node);
+}
+
+/**
+ * Frees, in a single pass, every node retired while the list was walked,
+ * and forgets the sets popped during the walk once it has finished.
+ */
+static void
+__idcmp_sweep_gadgets__(IDCMPEvents *events) {
+   IDCMPHandlerSet *set;
+   struct Node *node, *next;
+
+   if (events->GadgetWalkers) {
+      return;
+   }
+
+   while (NULL != (set = events->WalkedSets)) {
+      events->WalkedSets = set->NextWalked;
+      set->NextWalked = NULL;
+      set->Walked = NULL;
+   }
+
+   if (!events->GadgetSweep) {
+      return;
+   }
+
+   events->GadgetSweep = FALSE;
+
+   for (
+      node = events->GadgetEvents.lh_Head; 
+      NULL != (next = node->ln_Succ); 
+      node = next
+   ) {
+      if (((GadgetEventNode *)node)->gadget == NULL) {
+         Remove(node);
+         __idcmp_free_gadget_node__((GadgetEventNode *)node);
+      }
+   }
+}
+
+/**
+ * Keeps the index in step with a resized window. Only gadgets positioned
+ * or sized relative to the window move, so only those are re-indexed,
+ * unless the window has outgrown the grid and it must be rebuilt.
+ */
+static void
+__idcmp_hitgrid_resize__(IDCMPEvents *events, struct Window *window) {
+   struct IDCMPHitGrid *grid = events->HitGrid;
+   struct Node *node;
+   GadgetEventNode *eventNode;
+
+   if (
+      ((window->Width + (1 << IDCMP_HIT_CELL_SHIFT) - 1) >> IDCMP_HIT_CELL_SHIFT) > grid->columns ||
+      ((window->Height + (1 << IDCMP_HIT_CELL_SHIFT) - 1) >> IDCMP_HIT_CELL_SHIFT) > grid->rows
+   ) {
+      EnableGadgetHitTest(events, window);
+      return;
+   }
+
+   for (
+      node = events->GadgetEvents.lh_Head; 
+      node->ln_Succ != NULL; 
+      node = node->ln_Succ
+   ) {
+      eventNode = (GadgetEventNode *)node;
+
+      if (eventNode->gadget && eventNode->gadget->Flags & IDCMP_RELATIVE_GADGET) {
+         __idcmp_hitgrid_remove__(grid, eventNode);
+         __idcmp_hitgrid_insert__(grid, window, eventNode);
+      }
+   }
+
+   grid->width = window->Width;
+   grid->height = window->Height;
+}
+
+/**
+ * Works out which gadget is now under the pointer and, if that changed,
+ * delivers GADGET_LEAVE to the old one and GADGET_ENTER to the new one.
+ */
+static IDCMPState
+__idcmp_update_hover__(
+   IDCMPEvents *events,
+   struct Window *window,
+   struct IntuiMessage *message
+) {
+   GadgetEventNode *previous = events->Hover;
+   GadgetEventNode *current = HitTestGadget(
+      events, window->MouseX, window->MouseY
+   );
+   IDCMPState state = STATE_NO_CHANGE;
+
+   if (current == previous) {
+      return STATE_NO_CHANGE;
+   }
+
+   events->Hover = current;
+   events->GadgetWalkers++;
+
+   if (previous && (previous->type & GADGET_LEAVE)) {
+      if (previous->handler(previous->gadget, window, message, GADGET_LEAVE)) {
+         state = STATE_FINISHED;
+      }
+   }
+
+   /* The leave handler may have removed the node being entered */
+   if (
+      state != STATE_FINISHED && 
+      current && (current->type & GADGET_ENTER)
+   ) {
+      if (current->handler(current->gadget, window, message, GADGET_ENTER)) {
+         state = STATE_FINISHED;
+      }
+   }
+
+   events->GadgetWalkers--;
+   __idcmp_sweep_gadgets__(events);
+
+   return state;
+}
+
+/*
+ * The copy of a message handed to the handlers. Keeping the events instance
+ * alongside it is what lets `GetIDCMPEvents` find a handler's context from
+ * nothing more than its message pointer.
+ */
+typedef struct IDCMPBatchMessage {
+   struct IntuiMessage message;
+   IDCMPEvents *events;
+   UBYTE lane;
+} IDCMPBatchMessage;
+
+/*
+ * Dispatch lanes; a batch is dispatched one lane at a time, in this order,
+ * preserving arrival order within each lane.
+ */
+#define IDCMP_LANE_VERIFY 0
+#define IDCMP_LANE_CRITICAL 1
+#define IDCMP_LANE_BULK 2
+#define IDCMP_LANES 3
+
+/*
+ * Messages drained from the UserPort in one go, along with the storage for
+ * any IDCMP_IDCMPUPDATE tag lists that had to be copied before replying.
+ * Batches belong to the events so that anything left undispatched survives
+ * until the next call. A batch is only refilled once it has been fully
+ * dispatched and no handler is still working on one of its messages, so
+ * loops nested inside handlers may need more than one.
+ */
+typedef struct IDCMPBatch {
+   struct IDCMPBatch *next;
+   UWORD busy;
+   UWORD count;
+   UWORD updates;
+   BOOL full;
+
+   /* The lane and index to look at next, and what each lane has left */
+   UWORD lane;
+   UWORD index;
+   UWORD lanes[IDCMP_LANES];
+
+   /* Verify messages found on the UserPort after the batch was filled */
+   UWORD verifies;
+   UWORD verifyNext;
+
+   IDCMPBatchMessage messages[IDCMP_BATCH_SIZE];
+   IDCMPBatchMessage verify[IDCMP_VERIFY_SLOTS];
+   IDCMPUpdateRecord records[IDCMP_UPDATE_SLOTS];
+} IDCMPBatch;
+
+/**
+ * Returns the oldest batch that still has messages to dispatch.
+ */
+static IDCMPBatch *
+__idcmp_pending_batch__(IDCMPEvents *events) {
+   IDCMPBatch *batch;
+
+   for (batch = events->Batches; batch; batch = batch->next) {
+      if (
+         batch->verifyNext < batch->verifies ||
+         batch->lanes[IDCMP_LANE_VERIFY] || 
+         batch->lanes[IDCMP_LANE_CRITICAL] || 
+         batch->lanes[IDCMP_LANE_BULK]
+      ) {
+         return batch;
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * Forgets every message not yet dispatched; all of them have already been
+ * replied, so nothing more than the cursors has to change.
+ */
+static void
+__idcmp_drop_batches__(IDCMPEvents *events) {
+   IDCMPBatch *batch;
+
+   for (batch = events->Batches; batch; batch = batch->next) {
+      batch->verifyNext = batch->verifies;
+      batch->lane = IDCMP_LANES;
+      batch->index = batch->count;
+      batch->lanes[IDCMP_LANE_VERIFY] = 0;
+      batch->lanes[IDCMP_LANE_CRITICAL] = 0;
+      batch->lanes[IDCMP_LANE_BULK] = 0;
+   }
+}
+
 /**
  * Predefined basic function that ensures the application message loop exits
- * when the close gadget is pressed. 
+ * when the close gadget is pressed. A verify message still deferred for the
+ * window is allowed before it is closed.
  * 
  * @param window an instance of `struct Window *` that represents the open 
  * window being acted upon
@@ -25,6 +514,17 @@ __idcmp_events_close_window__(
    struct Window *window, 
    struct IntuiMessage *message
 ) {
+   IDCMPEvents *events = GetIDCMPEvents(message);
+
+   /* Intuition must not be left waiting on a window that is going away */
+   ReplyIDCMPVerify(events, VERIFY_ALLOW);
+
+   /* What is left refers to the window, its gadgets for instance */
+   if (events) {
+      __idcmp_drop_batches__(events);
+      events->VerifyScanned = NULL;
+   }
+
    if (window) {
       CloseWindow(window);
    }
@@ -32,332 +532,1676 @@ __idcmp_events_close_window__(
    return  STATE_FINISHED;
 }
 
+const IDCMPHandlers IDCMPBasicHandlers = {
+   NULL,                            /* ActiveWindow */
+   NULL,                            /* ChangeWindow */
+   __idcmp_events_close_window__    /* DismissWindow */
+};
+
+/* Stands in for a missing handler table so dispatch need not test for it */
+static const IDCMPHandlers __idcmp_no_handlers__;
+
 void 
 InitializeIDCMPEvents(IDCMPEvents *events) {
    memset(events, 0L, sizeof(IDCMPEvents));
 
-   /* Prepare the exec list for the gadget handlers */
-   events->GadgetEvents = AllocVec(sizeof(struct List), MEMF_ANY|MEMF_CLEAR);
-   NewList(events->GadgetEvents);
+   /* Prepare the exec lists for the gadget handlers and idle jobs */
+   NewList(&events->GadgetEvents);
+   NewList(&events->IdleJobs);
+   events->IdleBudget = IDCMP_IDLE_BUDGET;
+
+   /* Kept out of line so the instance stays small enough for the stack */
+   events->FlightLog = AllocVec(
+      sizeof(IDCMPFlightRecord) * IDCMP_FLIGHT_RECORDS, 
+      MEMF_CLEAR|MEMF_ANY
+   );
+}
+
+IDCMPEvents *
+AllocIDCMPEvents(const IDCMPHandlers *handlers, APTR userData) {
+   IDCMPEvents *events = AllocVec(sizeof(IDCMPEvents), MEMF_ANY);
+
+   if (events) {
+      InitializeIDCMPEvents(events);
+      events->Handlers = handlers;
+      events->UserData = userData;
+   }
+
+   return events;
 }
 
 void 
 FreeIDCMPEvents(IDCMPEvents *events, BOOL freeOnlyContents) {
-   struct List *list = events != NULL ? events->GadgetEvents : NULL;
+   struct List *list = events != NULL ? &events->GadgetEvents : NULL;
    struct Node *node = NULL;
 
    if (list == NULL || events == NULL) {
       return;
    }
 
+   ReplyIDCMPVerify(events, VERIFY_ALLOW);
+
+   /* Bring back the base handlers; what the sets replaced is freed below */
+   while (events->HandlerSets) {
+      PopIDCMPHandlers(events, NULL);
+   }
+
    while (!IsListEmpty(list) && (node = list->lh_Head)) {
       GadgetEventNode *gadgetNode = (GadgetEventNode *)node;
       RemHead(list);
 
       if (gadgetNode) {
-         FreeVec(gadgetNode);
+         __idcmp_free_gadget_node__(gadgetNode);
       }
    }
 
+   while (NULL != (node = RemHead(&events->IdleJobs))) {
+      FreeVec(node);
+   }
+
+   if (events->UpdateRoutes) {
+      FreeVec(events->UpdateRoutes);
+      events->UpdateRoutes = NULL;
+      events->UpdateRouteCount = 0;
+   }
+
+   __idcmp_hitgrid_free__(events->HitGrid);
+   events->HitGrid = NULL;
+   events->HitWindow = NULL;
+   events->Hover = NULL;
+   events->ActiveStream = NULL;
+   events->ValueStreams = 0;
+
+   if (events->PostSignal) {
+      FreeSignal(events->PostSigBit);
+      events->PostSignal = 0L;
+      events->PostSigBit = -1;
+   }
+
+   if (events->Posted) {
+      FreeVec(events->Posted);
+      events->Posted = NULL;
+   }
+   events->PostHead = events->PostTail = 0;
+
+   if (events->FlightLog) {
+      FreeVec(events->FlightLog);
+      events->FlightLog = NULL;
+   }
+
+   while (events->Batches) {
+      IDCMPBatch *batch = events->Batches;
+
+      events->Batches = batch->next;
+      FreeVec(batch);
+   }
+
    if (!freeOnlyContents) {
-      FreeVec(list);
+      FreeVec(events);
    }
 }
 
 void 
 ApplyIDCMPBasics(IDCMPEvents *events) {
-   events->DismissWindow = __idcmp_events_close_window__;
+   if (!events->Handlers) {
+      events->Handlers = &IDCMPBasicHandlers;
+   }
 }
 
-void
-HandleIDCMP(
-   IDCMPEvents *events, 
-   struct Window *window, 
-    IDCMPState initialDone
-) {
-    IDCMPState done = initialDone;
+/**
+ * Puts any shed classes back onto the window and notifies the application.
+ */
+static void
+__idcmp_restore_shed__(IDCMPEvents *events, struct Window *window) {
+   ULONG classes = events->ShedActive;
 
-   do {
-      ULONG signals = Wait(1L << window->UserPort->mp_SigBit);
-      if (signals & (1L << window->UserPort->mp_SigBit)) {
-          IDCMPState state = ProcessIDCMPMessage(events, window);
+   if (!classes) { return; }
 
-         if (state !=  STATE_NO_CHANGE) {
-            done = state;
+   events->ShedActive = 0L;
+   events->ShedCalmWakeups = 0;
+   ModifyIDCMP(window, window->IDCMPFlags | classes);
+
+   if (events->Handlers && events->Handlers->LoadShed) {
+      events->Handlers->LoadShed(window, classes, FALSE);
+   }
+}
+
+/**
+ * Applies the load shedding policy using the depth of the queue that was
+ * just drained. Classes are only stripped if the window would still be
+ * left with some IDCMP flags, as a zero mask closes the UserPort.
+ */
+static void
+__idcmp_adapt_load__(IDCMPEvents *events, struct Window *window) {
+   ULONG classes;
+
+   if (!events->ShedHighWater) { return; }
+
+   if (!events->ShedActive) {
+      classes = window->IDCMPFlags & events->ShedClasses;
+
+      if (
+         events->QueueDepth >= events->ShedHighWater && 
+         classes && 
+         (window->IDCMPFlags & ~classes)
+      ) {
+         events->ShedActive = classes;
+         events->ShedCalmWakeups = 0;
+         ModifyIDCMP(window, window->IDCMPFlags & ~classes);
+
+         if (events->Handlers && events->Handlers->LoadShed) {
+            events->Handlers->LoadShed(window, classes, TRUE);
          }
       }
+
+      return;
+   }
+
+   if (events->QueueDepth > events->ShedLowWater) {
+      events->ShedCalmWakeups = 0;
+   }
+   else if (++events->ShedCalmWakeups >= events->ShedRestoreWakeups) {
+      __idcmp_restore_shed__(events, window);
    }
-   while (done !=  STATE_FINISHED);
 }
 
-IDCMPState 
-ProcessIDCMPMessage(
-   IDCMPEvents *events, 
-   struct Window *window
+void
+SetIDCMPLoadShedding(
+   IDCMPEvents *events,
+   struct Window *window,
+   ULONG classes,
+   UWORD highWater,
+   UWORD lowWater,
+   UWORD restoreWakeups
 ) {
-   struct IntuiMessage *message;
-   USHORT code;
-   ULONG class;
-   IDCMPMouseButton buttons = NO_BUTTON;
+   if (!events) { return; }
 
-   while (NULL != (message = (struct IntuiMessage *)GetMsg(window->UserPort))) {
-      class = message->Class;
-      code = message->Code;
+   if (window && (!highWater || (events->ShedActive & ~classes))) {
+      __idcmp_restore_shed__(events, window);
+   }
 
-      ReplyMsg((struct Message *)message);
+   events->ShedClasses = classes;
+   events->ShedHighWater = highWater;
+   events->ShedLowWater = lowWater;
+   events->ShedRestoreWakeups = restoreWakeups;
+}
 
-      switch (class) {
-         case IDCMP_ACTIVEWINDOW:
-            if (events->ActiveWindow) {
-               return events->ActiveWindow(window, message);
-            }
-            break;
+/**
+ * Runs a single slice of the job at the head of the idle queue, moving it
+ * to the back of the queue if it has more to do or freeing it otherwise.
+ */
+static void
+__idcmp_run_idle__(IDCMPEvents *events, struct Window *window) {
+   IdleJobNode *job = (IdleJobNode *)RemHead(&events->IdleJobs);
+   IDCMPIdleSlice slice;
+   BOOL more;
 
-         case IDCMP_CHANGEWINDOW:
-            if (events->ChangeWindow) {
-               return events->ChangeWindow(window, message);
-            }
-            break;
+   if (!job) { return; }
 
-         case IDCMP_CLOSEWINDOW:
-            if (events->DismissWindow) {
-               return events->DismissWindow(window, message);
-            }
-            break;
+   CurrentTime(&slice.Seconds, &slice.Micros);
+   slice.Budget = events->IdleBudget;
 
-         case IDCMP_DELTAMOVE:
-            if (events->DeltaMove) {
-               return events->DeltaMove(window, message);
-            }
-            break;
+   events->IdleRunning = job;
+   events->IdleCancelled = FALSE;
 
-         case IDCMP_DISKINSERTED:
-            if (events->DiskInserted) {
-               return events->DiskInserted(window, message);
-            }
-            break;
+   more = job->job(window, job->data, &slice);
 
-         case IDCMP_DISKREMOVED:
-            if (events->DiskRemoved) {
-               return events->DiskRemoved(window, message);
-            }
-            break;
+   events->IdleRunning = NULL;
 
-         case IDCMP_GADGETDOWN:
-            if (events->GadgetDown) {
-               struct Gadget *gadget = (struct Gadget *)message->IAddress;
-               return events->GadgetDown(window, message, gadget);
-            }
-            break;
+   if (more && !events->IdleCancelled) {
+      AddTail(&events->IdleJobs, (struct Node *)job);
+   }
+   else {
+      FreeVec(job);
+   }
+}
 
-         case IDCMP_GADGETHELP:
-            if (events->GadgetHelp) {
-               struct Gadget *gadget = (struct Gadget *)message->IAddress;
-               return events->GadgetHelp(window, message, gadget);
-            }
-            break;
+/* The most whole seconds whose microseconds still fit in a ULONG */
+#define IDCMP_MAX_SECONDS (0xFFFFFFFF / 1000000L - 1)
 
-         case IDCMP_GADGETUP:
-            if (events->GadgetUp) {
-               struct Gadget *gadget = (struct Gadget *)message->IAddress;
-               return events->GadgetUp(window, message, gadget);
-            }
-            break;
+/**
+ * Returns the microseconds from one Intuition timestamp to a later one,
+ * clamped to zero should the second come first and to 0xFFFFFFFF should
+ * they be more than about 71 minutes apart.
+ */
+static ULONG
+__idcmp_micros_between__(
+   ULONG fromSeconds, 
+   ULONG fromMicros, 
+   ULONG toSeconds, 
+   ULONG toMicros
+) {
+   if (toSeconds < fromSeconds || (toSeconds == fromSeconds && toMicros < fromMicros)) {
+      return 0L;
+   }
 
-         case IDCMP_IDCMPUPDATE:
-            if (events->IdcmpUpdate) {
-               return events->IdcmpUpdate(window, message);
+   if (toSeconds - fromSeconds > IDCMP_MAX_SECONDS) {
+      return 0xFFFFFFFF;
+   }
+
+   return ((toSeconds - fromSeconds) * 1000000L) + toMicros - fromMicros;
+}
+
+/**
+ * Appends an entry to the flight recorder, overwriting the oldest one.
+ */
+static void
+__idcmp_record__(
+   IDCMPEvents *events,
+   IDCMPFlightKind kind,
+   ULONG class,
+   UWORD code,
+   APTR handler,
+   LONG state,
+   ULONG seconds,
+   ULONG micros
+) {
+   IDCMPFlightRecord *record;
+
+   if (!events->FlightLog) { return; }
+
+   record = &events->FlightLog[
+      events->FlightCount++ & (IDCMP_FLIGHT_RECORDS - 1)
+   ];
+
+   record->Class = class;
+   record->Handler = handler;
+   record->Seconds = seconds;
+   record->Micros = micros;
+   record->Code = code;
+   record->Depth = (UWORD)events->QueueDepth;
+   record->Kind = (UBYTE)kind;
+   record->State = (BYTE)state;
+}
+
+/**
+ * Names the handler a message is routed to, for the flight recorder. For
+ * IDCMP_IDCMPUPDATE a GA_ID route takes precedence over the table, just as
+ * it does when dispatching.
+ */
+static APTR
+__idcmp_chosen_handler__(
+   IDCMPEvents *events, 
+   const IDCMPHandlers *handlers,
+   struct IntuiMessage *message
+) {
+   IDCMPUpdateRecord *update;
+
+   switch (message->Class) {
+      case IDCMP_ACTIVEWINDOW: return (APTR)handlers->ActiveWindow;
+      case IDCMP_CHANGEWINDOW: return (APTR)handlers->ChangeWindow;
+      case IDCMP_CLOSEWINDOW: return (APTR)handlers->DismissWindow;
+      case IDCMP_DELTAMOVE: return (APTR)handlers->DeltaMove;
+      case IDCMP_DISKINSERTED: return (APTR)handlers->DiskInserted;
+      case IDCMP_DISKREMOVED: return (APTR)handlers->DiskRemoved;
+      case IDCMP_GADGETDOWN: return (APTR)handlers->GadgetDown;
+      case IDCMP_GADGETHELP: return (APTR)handlers->GadgetHelp;
+      case IDCMP_GADGETUP: return (APTR)handlers->GadgetUp;
+      case IDCMP_IDCMPUPDATE:
+         update = (IDCMPUpdateRecord *)message->IAddress;
+
+         if (
+            update && 
+            update->GadgetID < events->UpdateRouteCount && 
+            events->UpdateRoutes[update->GadgetID]
+         ) {
+            return (APTR)events->UpdateRoutes[update->GadgetID];
+         }
+
+         return (APTR)handlers->IdcmpUpdate;
+      case IDCMP_INACTIVEWINDOW: return (APTR)handlers->InactiveWindow;
+      case IDCMP_INTUITICKS: return (APTR)handlers->IntuiTicks;
+      case IDCMP_LONELYMESSAGE: return (APTR)handlers->LonelyMessage;
+      case IDCMP_MENUHELP: return (APTR)handlers->MenuHelp;
+      case IDCMP_MENUPICK: return (APTR)handlers->MenuPick;
+      case IDCMP_MENUVERIFY: return (APTR)handlers->MenuVerify;
+      case IDCMP_MOUSEBUTTONS: return (APTR)handlers->MouseButtons;
+      case IDCMP_MOUSEMOVE: return (APTR)handlers->MouseMove;
+      case IDCMP_NEWPREFS: return (APTR)handlers->NewPrefs;
+      case IDCMP_NEWSIZE: return (APTR)handlers->NewSize;
+      case IDCMP_RAWKEY: return (APTR)handlers->RawKey;
+      case IDCMP_REFRESHWINDOW: return (APTR)handlers->RefreshWindow;
+      case IDCMP_REQCLEAR: return (APTR)handlers->ReqClear;
+      case IDCMP_REQSET: return (APTR)handlers->ReqSet;
+      case IDCMP_REQVERIFY: return (APTR)handlers->ReqVerify;
+      case IDCMP_SIZEVERIFY: return (APTR)handlers->SizeVerify;
+      case IDCMP_VANILLAKEY: return (APTR)handlers->VanillaKey;
+      case IDCMP_WBENCHMESSAGE: return (APTR)handlers->WorkbenchMessage;
+      case IDCMP_APPEVENT: return (APTR)handlers->AppEvent;
+      default: return NULL;
+   }
+}
+
+BOOL
+EnableIDCMPPosting(IDCMPEvents *events, BOOL otherTasks) {
+   BYTE sigBit;
+
+   if (!events) { return FALSE; }
+
+   if (!events->Posted) {
+      events->Posted = AllocVec(
+         sizeof(IDCMPPostedEvent) * IDCMP_POST_CAPACITY, 
+         MEMF_CLEAR|MEMF_ANY
+      );
+
+      if (!events->Posted) { return FALSE; }
+
+      events->PostHead = events->PostTail = 0;
+      events->PostTask = FindTask(NULL);
+   }
+
+   if (otherTasks && !events->PostSignal) {
+      if (-1 == (sigBit = AllocSignal(-1L))) { return FALSE; }
+
+      events->PostSigBit = sigBit;
+      events->PostSignal = 1L << sigBit;
+   }
+
+   return TRUE;
+}
+
+BOOL
+PostIDCMPEvent(
+   IDCMPEvents *events,
+   ULONG class,
+   UWORD code,
+   UWORD qualifier,
+   APTR iAddress
+) {
+   IDCMPPostedEvent *posted;
+   ULONG seconds, micros;
+
+   if (!events || !events->Posted) { return FALSE; }
+
+   /* Without the signal nothing would wake the owner for another task */
+   if (!events->PostSignal && FindTask(NULL) != events->PostTask) {
+      return FALSE;
+   }
+
+   CurrentTime(&seconds, &micros);
+
+   /* Other tasks may post as well; only the owner ever advances PostHead */
+   Forbid();
+
+   if ((UWORD)(events->PostTail - events->PostHead) >= IDCMP_POST_CAPACITY) {
+      Permit();
+      return FALSE;
+   }
+
+   posted = &events->Posted[events->PostTail & (IDCMP_POST_CAPACITY - 1)];
+   posted->Class = class;
+   posted->IAddress = iAddress;
+   posted->Seconds = seconds;
+   posted->Micros = micros;
+   posted->Code = code;
+   posted->Qualifier = qualifier;
+   events->PostTail++;
+
+   Permit();
+
+   if (events->PostSignal) {
+      Signal(events->PostTask, events->PostSignal);
+   }
+
+   return TRUE;
+}
+
+void
+DumpIDCMPFlightRecorder(IDCMPEvents *events, BPTR file) {
+   static const char *kinds[] = { "?", "dispatch", "wait", "wake", "watchdog" };
+   static const char format[] = 
+      "%-8s %5lu.%06lu class=%08lx code=%04lx handler=%08lx state=%ld depth=%lu\n";
+   IDCMPFlightRecord *record;
+   ULONG index;
+
+   if (!events || !events->FlightLog) { return; }
+
+   index = events->FlightCount > IDCMP_FLIGHT_RECORDS
+      ? events->FlightCount - IDCMP_FLIGHT_RECORDS
+      : 0L;
+
+   for (; index < events->FlightCount; index++) {
+      record = &events->FlightLog[index & (IDCMP_FLIGHT_RECORDS - 1)];
+
+      if (file) {
+         FPrintf(file, (CONST_STRPTR)format,
+            kinds[record->Kind <= FLIGHT_WATCHDOG ? record->Kind : 0],
+            record->Seconds, record->Micros,
+            record->Class, (ULONG)record->Code, (ULONG)record->Handler,
+            (LONG)record->State, (ULONG)record->Depth
+         );
+      }
+      else if (events->FlightPrinter) {
+         events->FlightPrinter((CONST_STRPTR)format,
+            kinds[record->Kind <= FLIGHT_WATCHDOG ? record->Kind : 0],
+            record->Seconds, record->Micros,
+            record->Class, (ULONG)record->Code, (ULONG)record->Handler,
+            (LONG)record->State, (ULONG)record->Depth
+         );
+      }
+   }
+
+   if (file) {
+      Flush(file);
+   }
+}
+
+void
+SetIDCMPFlightPrinter(IDCMPEvents *events, IDCMPFlightPrinter printer) {
+   if (!events) { return; }
+
+   events->FlightPrinter = printer;
+}
+
+void
+SetIDCMPWatchdog(IDCMPEvents *events, ULONG micros, BPTR file) {
+   if (!events) { return; }
+
+   events->WatchdogMicros = micros;
+   events->WatchdogFile = file;
+}
+
+void
+HandleIDCMP(
+   IDCMPEvents *events, 
+   struct Window *window, 
+    IDCMPState initialDone
+) {
+    IDCMPState done = initialDone;
+
+   do {
+      ULONG mask = (1L << window->UserPort->mp_SigBit) | events->PostSignal;
+      ULONG signals, seconds, micros, nowSeconds, nowMicros, elapsed;
+
+      /* Work through the idle jobs a slice at a time until input arrives */
+      while (
+         !IsListEmpty(&events->IdleJobs) && 
+         events->PostHead == events->PostTail &&
+         !__idcmp_pending_batch__(events) &&
+         !(SetSignal(0L, 0L) & mask)
+      ) {
+         __idcmp_run_idle__(events, window);
+      }
+
+      CurrentTime(&seconds, &micros);
+      __idcmp_record__(
+         events, FLIGHT_WAIT, mask, 0, NULL, STATE_NO_CHANGE, seconds, micros
+      );
+
+      /*
+       * Events posted by this task may not have signalled, and copies left
+       * by a finished handler were signalled long ago; neither waits
+       */
+      signals = (
+         events->PostHead != events->PostTail || 
+         __idcmp_pending_batch__(events)
+      ) ? mask : Wait(mask);
+
+      CurrentTime(&seconds, &micros);
+      __idcmp_record__(
+         events, FLIGHT_WAKE, signals, 0, NULL, STATE_NO_CHANGE, seconds, micros
+      );
+
+      if (signals & mask) {
+          IDCMPState state = ProcessIDCMPMessage(events, window);
+
+         if (state !=  STATE_NO_CHANGE) {
+            done = state;
+         }
+
+         /* The window may already be closed once a handler has finished */
+         if (state != STATE_FINISHED) {
+            __idcmp_adapt_load__(events, window);
+
+            if (events->WatchdogMicros) {
+               CurrentTime(&nowSeconds, &nowMicros);
+               elapsed = __idcmp_micros_between__(
+                  seconds, micros, nowSeconds, nowMicros
+               );
+
+               if (elapsed > events->WatchdogMicros) {
+                  events->WatchdogTrips++;
+                  __idcmp_record__(
+                     events, FLIGHT_WATCHDOG, elapsed, 0, NULL, state, 
+                     nowSeconds, nowMicros
+                  );
+                  DumpIDCMPFlightRecorder(events, events->WatchdogFile);
+               }
             }
-            break;
+         }
+      }
+   }
+   while (done !=  STATE_FINISHED);
+}
 
-         case IDCMP_INACTIVEWINDOW:
-            if (events->InactiveWindow) {
-               return events->InactiveWindow(window, message);
+/**
+ * Returns a batch that may be refilled, allocating one if every batch is
+ * still in use by a handler further up the stack.
+ */
+static IDCMPBatch *
+__idcmp_free_batch__(IDCMPEvents *events) {
+   IDCMPBatch *batch, **link = &events->Batches;
+
+   for (batch = events->Batches; batch; batch = batch->next) {
+      if (!batch->busy) {
+         return batch;
+      }
+
+      link = &batch->next;
+   }
+
+   batch = AllocVec(sizeof(IDCMPBatch), MEMF_CLEAR|MEMF_ANY);
+   if (batch) {
+      *link = batch;
+   }
+
+   return batch;
+}
+
+/**
+ * Takes the next message from a batch in lane order, advancing its cursor
+ * before the message is dispatched so nested loops continue after it.
+ */
+static struct IntuiMessage *
+__idcmp_next_message__(IDCMPBatch *batch) {
+   IDCMPBatchMessage *message;
+
+   if (batch->verifyNext < batch->verifies) {
+      return &batch->verify[batch->verifyNext++].message;
+   }
+
+   while (batch->lane < IDCMP_LANES) {
+      while (batch->lanes[batch->lane] && batch->index < batch->count) {
+         message = &batch->messages[batch->index++];
+
+         if (message->lane == batch->lane) {
+            batch->lanes[batch->lane]--;
+            return &message->message;
+         }
+      }
+
+      batch->lane++;
+      batch->index = 0;
+   }
+
+   return NULL;
+}
+
+/**
+ * Copies GA_ID and as many other tags as fit from an IDCMP_IDCMPUPDATE tag
+ * list into a record. The control tags are followed by hand so the library
+ * does not need utility.library to be open.
+ */
+static void
+__idcmp_decode_update__(struct TagItem *tags, IDCMPUpdateRecord *record) {
+   struct TagItem *tag;
+   UWORD count = 0;
+
+   record->GadgetID = IDCMP_UPDATE_NO_ID;
+
+   while ((tag = tags) != NULL && tag->ti_Tag != TAG_DONE) {
+      switch (tag->ti_Tag) {
+         case TAG_MORE:
+            tags = (struct TagItem *)tag->ti_Data;
+            continue;
+
+         case TAG_SKIP:
+            tags += tag->ti_Data + 1;
+            continue;
+
+         case TAG_IGNORE:
+            tags++;
+            continue;
+
+         case GA_ID:
+            record->GadgetID = tag->ti_Data;
+
+            /* Make room for GA_ID by dropping the last attribute */
+            if (count == IDCMP_UPDATE_MAX_TAGS) {
+               count--;
             }
             break;
 
-         case IDCMP_INTUITICKS:
-            if (events->IntuiTicks) {
-               return events->IntuiTicks(window, message);
+         default:
+            if (count == IDCMP_UPDATE_MAX_TAGS) {
+               tags++;
+               continue;
             }
             break;
+      }
+
+      record->Tags[count++] = *tag;
+      tags++;
+   }
+
+   record->Tags[count].ti_Tag = TAG_DONE;
+   record->Tags[count].ti_Data = 0L;
+   record->Count = count;
+}
 
-         case IDCMP_LONELYMESSAGE:
-            if (events->LonelyMessage) {
-               return events->LonelyMessage(window, message);
+/*
+ * A value stream is a gadget handler node carrying the state needed to
+ * decide when the application should hear about a new value.
+ */
+struct GadgetValueStream {
+   GadgetEventNode node;
+   IDCMPValueHandler handler;
+   IDCMPValueReader reader;
+   ULONG interval;
+   LONG value;
+   LONG latest;
+   ULONG seconds;
+   ULONG micros;
+   BOOL delivered;
+};
+
+/**
+ * The default IDCMPValueReader; see its description in idcmp.h.
+ */
+static BOOL
+__idcmp_read_value__(
+   struct Gadget *gadget, 
+   struct IntuiMessage *message, 
+   LONG *value
+) {
+   IDCMPUpdateRecord *update;
+   struct PropInfo *prop;
+   UWORD index;
+
+   if (message->Class == IDCMP_IDCMPUPDATE) {
+      if (NULL != (update = (IDCMPUpdateRecord *)message->IAddress)) {
+         for (index = 0; index < update->Count; index++) {
+            if (update->Tags[index].ti_Tag != GA_ID) {
+               *value = (LONG)update->Tags[index].ti_Data;
+               return TRUE;
             }
-            break;
+         }
+      }
+
+      return FALSE;
+   }
+
+   if (
+      (gadget->GadgetType & GTYP_GTYPEMASK) == GTYP_PROPGADGET && 
+      NULL != (prop = (struct PropInfo *)gadget->SpecialInfo)
+   ) {
+      *value = (prop->Flags & FREEVERT) ? prop->VertPot : prop->HorizPot;
+      return TRUE;
+   }
+
+   if (message->IAddress == (APTR)gadget) {
+      *value = message->Code;
+      return TRUE;
+   }
+
+   return FALSE;
+}
+
+/**
+ * Reads the stream's gadget and delivers the value if it changed and the
+ * interval since the previous delivery has passed; a final delivery skips
+ * both tests.
+ *
+ * @returns TRUE if the value handler asked for the event loop to end
+ */
+static BOOL
+__idcmp_sample_stream__(
+   struct Window *window,
+   struct IntuiMessage *message,
+   struct GadgetValueStream *stream,
+   BOOL final
+) {
+   IDCMPValueReader reader = stream->reader 
+      ? stream->reader 
+      : __idcmp_read_value__;
+   LONG value;
+
+   if (reader(stream->node.gadget, message, &value)) {
+      stream->latest = value;
+   }
+
+   if (!final) {
+      if (stream->delivered && stream->latest == stream->value) {
+         return FALSE;
+      }
+
+      if (
+         stream->delivered && 
+         __idcmp_micros_between__(
+            stream->seconds, stream->micros, message->Seconds, message->Micros
+         ) < stream->interval
+      ) {
+         return FALSE;
+      }
+   }
+
+   stream->value = stream->latest;
+   stream->delivered = TRUE;
+   stream->seconds = message->Seconds;
+   stream->micros = message->Micros;
+
+   return stream->handler(
+      stream->node.gadget, window, message, stream->value, final
+   );
+}
+
+/**
+ * Finds the value stream for a BOOPSI object by the GA_ID of an
+ * IDCMP_IDCMPUPDATE, trying the stream already being dragged first.
+ */
+static struct GadgetValueStream *
+__idcmp_find_stream__(IDCMPEvents *events, ULONG gadgetId) {
+   struct GadgetValueStream *stream = events->ActiveStream;
+   struct Node *node;
+
+   if (stream && stream->node.gadget->GadgetID == gadgetId) {
+      return stream;
+   }
+
+   for (
+      node = events->GadgetEvents.lh_Head; 
+      node->ln_Succ != NULL; 
+      node = node->ln_Succ
+   ) {
+      stream = (struct GadgetValueStream *)node;
+
+      if (
+         (stream->node.type & GADGET_VALUE) && 
+         stream->node.gadget && 
+         stream->node.gadget->GadgetID == gadgetId
+      ) {
+         return stream;
+      }
+   }
+
+   return NULL;
+}
+
+/**
+ * Invokes every gadget handler registered for the message's gadget and the
+ * given type, starting or finishing value streams along the way. Handlers
+ * may add or remove handlers while this runs.
+ *
+ * @returns STATE_FINISHED if a handler asked for the loop to end
+ */
+static IDCMPState
+__idcmp_dispatch_gadget__(
+   IDCMPEvents *events,
+   struct Window *window,
+   struct IntuiMessage *message,
+   GadgetEventType type
+) {
+   struct Gadget *gadget = (struct Gadget *)message->IAddress;
+   struct GadgetValueStream *stream;
+   GadgetEventNode *eventNode;
+   struct Node *node;
+   BOOL finished = FALSE;
+
+   if (!gadget || IsListEmpty(&events->GadgetEvents)) {
+      return STATE_NO_CHANGE;
+   }
+
+   events->GadgetWalkers++;
+
+   for (
+      node = events->GadgetEvents.lh_Head; 
+      node->ln_Succ != NULL && !finished; 
+      node = node->ln_Succ
+   ) {
+      eventNode = (GadgetEventNode *)node;
+
+      if (eventNode->gadget != gadget || !(eventNode->type & type)) {
+         continue;
+      }
 
-         case IDCMP_MENUHELP:
-            if (events->MenuHelp) {
-               return events->MenuHelp(window, message);
+      if (!(eventNode->type & GADGET_VALUE)) {
+         finished = eventNode->handler(gadget, window, message, type);
+         continue;
+      }
+
+      stream = (struct GadgetValueStream *)eventNode;
+      if (type == GADGET_DOWN) {
+         events->ActiveStream = stream;
+         finished = __idcmp_sample_stream__(window, message, stream, FALSE);
+      }
+      else {
+         if (events->ActiveStream == stream) {
+            events->ActiveStream = NULL;
+         }
+         finished = __idcmp_sample_stream__(window, message, stream, TRUE);
+      }
+   }
+
+   events->GadgetWalkers--;
+   __idcmp_sweep_gadgets__(events);
+
+   return finished ? STATE_FINISHED : STATE_NO_CHANGE;
+}
+
+/**
+ * Routes a single, already replied, copy of an IntuiMessage to the handler
+ * registered for its class.
+ *
+ * @param events the handlers to choose from
+ * @param window the window the message was received on
+ * @param message the batch copy of the message
+ * @param buttons the mouse button state accumulated across the batch
+ * @returns the handler's state or STATE_NO_CHANGE if there was no handler
+ */
+static IDCMPState
+__idcmp_dispatch_message__(
+   IDCMPEvents *events,
+   struct Window *window,
+   struct IntuiMessage *message,
+   IDCMPMouseButton *buttons
+) {
+   const IDCMPHandlers *handlers = events->Handlers 
+      ? events->Handlers 
+      : &__idcmp_no_handlers__;
+   USHORT code = message->Code;
+   ULONG class = message->Class;
+
+   switch (class) {
+      case IDCMP_ACTIVEWINDOW:
+         if (handlers->ActiveWindow) {
+            return handlers->ActiveWindow(window, message);
+         }
+         break;
+
+      case IDCMP_CHANGEWINDOW:
+         if (handlers->ChangeWindow) {
+            return handlers->ChangeWindow(window, message);
+         }
+         break;
+
+      case IDCMP_CLOSEWINDOW:
+         if (handlers->DismissWindow) {
+            return handlers->DismissWindow(window, message);
+         }
+         break;
+
+      case IDCMP_DELTAMOVE:
+         if (handlers->DeltaMove) {
+            return handlers->DeltaMove(window, message);
+         }
+         break;
+
+      case IDCMP_DISKINSERTED:
+         if (handlers->DiskInserted) {
+            return handlers->DiskInserted(window, message);
+         }
+         break;
+
+      case IDCMP_DISKREMOVED:
+         if (handlers->DiskRemoved) {
+            return handlers->DiskRemoved(window, message);
+         }
+         break;
+
+      case IDCMP_GADGETDOWN:
+         if (
+            __idcmp_dispatch_gadget__(events, window, message, GADGET_DOWN) == 
+            STATE_FINISHED
+         ) {
+            return STATE_FINISHED;
+         }
+
+         if (handlers->GadgetDown) {
+            struct Gadget *gadget = (struct Gadget *)message->IAddress;
+            return handlers->GadgetDown(window, message, gadget);
+         }
+         break;
+
+      case IDCMP_GADGETHELP:
+         if (
+            __idcmp_dispatch_gadget__(events, window, message, GADGET_HELP) == 
+            STATE_FINISHED
+         ) {
+            return STATE_FINISHED;
+         }
+
+         if (handlers->GadgetHelp) {
+            struct Gadget *gadget = (struct Gadget *)message->IAddress;
+            return handlers->GadgetHelp(window, message, gadget);
+         }
+         break;
+
+      case IDCMP_GADGETUP:
+         if (
+            __idcmp_dispatch_gadget__(events, window, message, GADGET_UP) == 
+            STATE_FINISHED
+         ) {
+            return STATE_FINISHED;
+         }
+
+         if (handlers->GadgetUp) {
+            struct Gadget *gadget = (struct Gadget *)message->IAddress;
+            return handlers->GadgetUp(window, message, gadget);
+         }
+         break;
+
+      case IDCMP_IDCMPUPDATE:
+         if (events->ValueStreams && message->IAddress) {
+            struct GadgetValueStream *stream = __idcmp_find_stream__(
+               events, ((IDCMPUpdateRecord *)message->IAddress)->GadgetID
+            );
+
+            if (stream) {
+               events->ActiveStream = stream;
+
+               if (__idcmp_sample_stream__(window, message, stream, FALSE)) {
+                  return STATE_FINISHED;
+               }
             }
-            break;
+         }
 
-         case IDCMP_MENUPICK:
-            if (events->MenuPick) {
-               return events->MenuPick(window, message);
+         if (events->UpdateRoutes && message->IAddress) {
+            IDCMPUpdateRecord *update = (IDCMPUpdateRecord *)message->IAddress;
+
+            if (
+               update->GadgetID < events->UpdateRouteCount &&
+               events->UpdateRoutes[update->GadgetID]
+            ) {
+               return events->UpdateRoutes[update->GadgetID](
+                  window, message, update
+               );
             }
+         }
+
+         if (handlers->IdcmpUpdate) {
+            return handlers->IdcmpUpdate(window, message);
+         }
+         break;
+
+      case IDCMP_INACTIVEWINDOW:
+         if (handlers->InactiveWindow) {
+            return handlers->InactiveWindow(window, message);
+         }
+         break;
+
+      case IDCMP_INTUITICKS:
+         if (
+            events->ActiveStream && 
+            __idcmp_sample_stream__(window, message, events->ActiveStream, FALSE)
+         ) {
+            return STATE_FINISHED;
+         }
+
+         if (handlers->IntuiTicks) {
+            return handlers->IntuiTicks(window, message);
+         }
+         break;
+
+      case IDCMP_LONELYMESSAGE:
+         if (handlers->LonelyMessage) {
+            return handlers->LonelyMessage(window, message);
+         }
+         break;
+
+      case IDCMP_MENUHELP:
+         if (handlers->MenuHelp) {
+            return handlers->MenuHelp(window, message);
+         }
+         break;
+
+      case IDCMP_MENUPICK:
+         if (handlers->MenuPick) {
+            return handlers->MenuPick(window, message);
+         }
+         break;
+
+
+      case IDCMP_MENUVERIFY:
+         if (handlers->MenuVerify) {
+            return handlers->MenuVerify(window, message);
+         }
+         break;
+
+      case IDCMP_MOUSEBUTTONS:
+         switch (code) {
+            case SELECTUP:
+               if ((*buttons & LEFT_MOUSE_DOWN) == LEFT_MOUSE_DOWN) {
+                  *buttons ^= LEFT_MOUSE_DOWN;
+               }
+
+               *buttons |= LEFT_MOUSE_UP;
+               break;
+            
+            case SELECTDOWN:
+               if ((*buttons & LEFT_MOUSE_UP) == LEFT_MOUSE_UP) {
+                  *buttons ^= LEFT_MOUSE_UP;
+               }
+
+               *buttons |= LEFT_MOUSE_DOWN;
+               break;
+            
+            case MENUUP:
+               if ((*buttons & RIGHT_MOUSE_DOWN) == RIGHT_MOUSE_DOWN) {
+                  *buttons ^= RIGHT_MOUSE_DOWN;
+               }
+
+               *buttons |= RIGHT_MOUSE_UP;
+               break;
+            
+            case MENUDOWN:
+               if ((*buttons & RIGHT_MOUSE_UP) == LEFT_MOUSE_UP) {
+                  *buttons ^= LEFT_MOUSE_UP;
+               }
+
+               *buttons |= LEFT_MOUSE_DOWN;
+               break;
+
+            case MIDDLEDOWN:
+               if ((*buttons & MIDDLE_MOUSE_UP) == MIDDLE_MOUSE_UP) {
+                  *buttons ^= MIDDLE_MOUSE_UP;
+               }
+
+               *buttons |= MIDDLE_MOUSE_DOWN;
+               break;
+
+            case MIDDLEUP:
+               if ((*buttons & MIDDLE_MOUSE_DOWN) == MIDDLE_MOUSE_DOWN) {
+                  *buttons ^= MIDDLE_MOUSE_DOWN;
+               }
+
+               *buttons |= MIDDLE_MOUSE_UP;
+               break;
+
+            default:
+               *buttons |= code;
+               break;
+         }
+         
+         if (handlers->MouseButtons) {
+            return handlers->MouseButtons(window, message, *buttons);
+         }
+         break;
+
+      case IDCMP_MOUSEMOVE:
+         if (
+            events->ActiveStream && 
+            __idcmp_sample_stream__(window, message, events->ActiveStream, FALSE)
+         ) {
+            return STATE_FINISHED;
+         }
+
+         if (
+            events->HitGrid && 
+            __idcmp_update_hover__(events, window, message) == STATE_FINISHED
+         ) {
+            return STATE_FINISHED;
+         }
+
+         if (handlers->MouseMove) {
+            BOOL gz = (window->Flags & WFLG_GIMMEZEROZERO) == WFLG_GIMMEZEROZERO;
+            WORD x = gz ? window->GZZMouseX : window->MouseX;
+            WORD y = gz ? window->GZZMouseY : window->MouseY;
+
+            return handlers->MouseMove(window, message, x, y);
+         }
+         break;
+
+      case IDCMP_NEWPREFS:
+         if (handlers->NewPrefs) {
+            return handlers->NewPrefs(window, message);
+         }
+         break;
+
+      case IDCMP_NEWSIZE:
+         if (events->HitGrid) {
+            __idcmp_hitgrid_resize__(events, window);
+         }
+
+         if (handlers->NewSize) {
+            return handlers->NewSize(window, message);
+         }
+         break;
+
+      case IDCMP_RAWKEY:
+         if (handlers->RawKey) {
+            return handlers->RawKey(window, message);
+         }
+         break;
+
+      case IDCMP_REFRESHWINDOW:
+         if (handlers->RefreshWindow) {
+            return handlers->RefreshWindow(window, message);
+         }
+         break;
+
+      case IDCMP_REQCLEAR:
+         if (handlers->ReqClear) {
+            return handlers->ReqClear(window, message);
+         }
+         break;
+
+      case IDCMP_REQSET:
+         if (handlers->ReqSet) {
+            return handlers->ReqSet(window, message);
+         }
+         break;
+
+      case IDCMP_REQVERIFY:
+         if (handlers->ReqVerify) {
+            return handlers->ReqVerify(window, message);
+         }
+         break;
+
+      case IDCMP_SIZEVERIFY:
+         if (handlers->SizeVerify) {
+            return handlers->SizeVerify(window, message);
+         }
+         break;
+
+      case IDCMP_VANILLAKEY:
+         if (handlers->VanillaKey) {
+            return handlers->VanillaKey(window, message);
+         }
+         break;
+
+      case IDCMP_WBENCHMESSAGE:
+         if (handlers->WorkbenchMessage) {
+            return handlers->WorkbenchMessage(window, message);
+         }
+         break;
+
+      case IDCMP_APPEVENT:
+         if (handlers->AppEvent) {
+            return handlers->AppEvent(window, message);
+         }
+         break;
+               
+      default:
+         break;
+   }
+
+   return  STATE_NO_CHANGE;
+}
+
+/**
+ * Returns the number of microseconds elapsed since the supplied Intuition
+ * timestamp, clamped as `__idcmp_micros_between__` does.
+ */
+static ULONG
+__idcmp_elapsed_micros__(ULONG seconds, ULONG micros) {
+   ULONG nowSeconds, nowMicros;
+
+   CurrentTime(&nowSeconds, &nowMicros);
+
+   return __idcmp_micros_between__(seconds, micros, nowSeconds, nowMicros);
+}
+
+/**
+ * Replies to a verify message, applying the answer first, and records the
+ * time between Intuition sending it and this reply.
+ */
+static void
+__idcmp_reply_verify__(
+   IDCMPEvents *events,
+   struct IntuiMessage *message,
+   IDCMPVerifyAnswer answer
+) {
+   ULONG seconds = message->Seconds;
+   ULONG micros = message->Micros;
+   ULONG latency;
+
+   if (
+      answer == VERIFY_CANCEL && 
+      message->Class == IDCMP_MENUVERIFY && 
+      message->Code == MENUHOT
+   ) {
+      message->Code = MENUCANCEL;
+   }
+
+   ReplyMsg((struct Message *)message);
+
+   latency = __idcmp_elapsed_micros__(seconds, micros);
+   if (latency > events->VerifyMaxLatency) {
+      events->VerifyMaxLatency = latency;
+   }
+}
+
+/**
+ * Answers a verify message through the handler table's `VerifyFast`
+ * handler or `VerifyDefault` policy, replying at once unless the answer is
+ * to defer. The message must already have been copied by the caller.
+ *
+ * @returns the answer given; VERIFY_DEFER only if the message was held
+ */
+static IDCMPVerifyAnswer
+__idcmp_answer_verify__(
+   IDCMPEvents *events,
+   struct Window *window,
+   struct IntuiMessage *message
+) {
+   const IDCMPHandlers *handlers = events->Handlers 
+      ? events->Handlers 
+      : &__idcmp_no_handlers__;
+   IDCMPVerifyAnswer answer = handlers->VerifyFast 
+      ? handlers->VerifyFast(window, message)
+      : handlers->VerifyDefault;
+
+   /* Only one verify can ever be outstanding; Intuition is frozen */
+   if (answer == VERIFY_DEFER && events->DeferredVerify == NULL) {
+      events->DeferredVerify = message;
+      return VERIFY_DEFER;
+   }
+
+   if (answer == VERIFY_DEFER) {
+      answer = VERIFY_ALLOW;
+   }
+
+   __idcmp_reply_verify__(events, message, answer);
+
+   return answer;
+}
+
+/**
+ * Takes every verify message off the UserPort, wherever it is queued, and
+ * answers it, keeping a copy in the batch for dispatch if there is room.
+ * Called before each message is dispatched, so a verify queued behind a
+ * full batch waits for one handler at most rather than the whole batch.
+ * Only messages queued since the last call are searched; Intuition adds
+ * at the tail and only the drain, which forgets the mark, takes others.
+ */
+static void
+__idcmp_answer_port_verifies__(
+   IDCMPEvents *events,
+   struct Window *window,
+   IDCMPBatch *batch
+) {
+   struct List *list = &window->UserPort->mp_MsgList;
+   struct IntuiMessage *message;
+   IDCMPBatchMessage *copy;
+   struct Node *node;
+
+   for (;;) {
+      message = NULL;
+
+      /* Intuition may be queuing more messages while the list is walked */
+      Disable();
+      node = events->VerifyScanned 
+         ? events->VerifyScanned->ln_Succ 
+         : list->lh_Head;
+
+      for (; node->ln_Succ != NULL; node = node->ln_Succ) {
+         if (((struct IntuiMessage *)node)->Class & VERIFY_IDCMP_EVENTS) {
+            Remove(node);
+            message = (struct IntuiMessage *)node;
             break;
+         }
 
+         events->VerifyScanned = node;
+      }
+      Enable();
 
-         case IDCMP_MENUVERIFY:
-            if (events->MenuVerify) {
-               return events->MenuVerify(window, message);
-            }
+      if (!message) {
+         return;
+      }
+
+      if (!batch || batch->verifies >= IDCMP_VERIFY_SLOTS) {
+         __idcmp_answer_verify__(events, window, message);
+         continue;
+      }
+
+      copy = &batch->verify[batch->verifies++];
+      copy->message = *message;
+      copy->events = events;
+      copy->lane = IDCMP_LANE_VERIFY;
+
+      if (
+         __idcmp_answer_verify__(events, window, message) == VERIFY_CANCEL &&
+         copy->message.Class == IDCMP_MENUVERIFY && 
+         copy->message.Code == MENUHOT
+      ) {
+         copy->message.Code = MENUCANCEL;
+      }
+   }
+}
+
+/**
+ * Pulls up to IDCMP_BATCH_SIZE messages from the window's UserPort, copying
+ * each into the batch and replying to it straight away. Verify messages are
+ * answered here, before anything is dispatched, so Intuition is only kept
+ * waiting for as long as it takes to copy the messages ahead of them.
+ *
+ * @returns the number of messages copied into the batch
+ */
+static ULONG
+__idcmp_drain_port__(
+   IDCMPEvents *events,
+   struct Window *window,
+   IDCMPBatch *batch
+) {
+   struct IntuiMessage *message, *copy;
+   IDCMPUpdateRecord *record;
+   IDCMPPostedEvent *posted;
+   ULONG count = 0;
+
+   /* The mark may be among the messages about to be taken */
+   events->VerifyScanned = NULL;
+
+   batch->updates = 0;
+   batch->lane = 0;
+   batch->index = 0;
+   batch->verifies = 0;
+   batch->verifyNext = 0;
+   batch->lanes[IDCMP_LANE_VERIFY] = 0;
+   batch->lanes[IDCMP_LANE_CRITICAL] = 0;
+   batch->lanes[IDCMP_LANE_BULK] = 0;
+
+   while (
+      count < IDCMP_BATCH_SIZE && 
+      batch->updates < IDCMP_UPDATE_SLOTS &&
+      NULL != (message = (struct IntuiMessage *)GetMsg(window->UserPort))
+   ) {
+      copy = &batch->messages[count].message;
+      batch->messages[count].events = events;
+      batch->messages[count].lane = 
+         (message->Class & VERIFY_IDCMP_EVENTS) ? IDCMP_LANE_VERIFY :
+         (message->Class & events->BulkClasses) ? IDCMP_LANE_BULK :
+         IDCMP_LANE_CRITICAL;
+      batch->lanes[batch->messages[count++].lane]++;
+      *copy = *message;
+
+      if (message->Class & VERIFY_IDCMP_EVENTS) {
+         if (
+            __idcmp_answer_verify__(events, window, message) == VERIFY_CANCEL &&
+            copy->Class == IDCMP_MENUVERIFY && 
+            copy->Code == MENUHOT
+         ) {
+            copy->Code = MENUCANCEL;
+         }
+         continue;
+      }
+
+      if (message->Class == IDCMP_IDCMPUPDATE && message->IAddress) {
+         record = &batch->records[batch->updates++];
+         __idcmp_decode_update__((struct TagItem *)message->IAddress, record);
+         copy->IAddress = record->Tags;
+      }
+
+      ReplyMsg((struct Message *)message);
+   }
+
+   /* Posted events share what is left of the batch, in the order posted */
+   while (
+      count < IDCMP_BATCH_SIZE && 
+      batch->updates < IDCMP_UPDATE_SLOTS &&
+      events->PostHead != events->PostTail
+   ) {
+      posted = &events->Posted[events->PostHead & (IDCMP_POST_CAPACITY - 1)];
+      copy = &batch->messages[count].message;
+      batch->messages[count].events = events;
+      batch->messages[count].lane = 
+         (posted->Class & VERIFY_IDCMP_EVENTS) ? IDCMP_LANE_VERIFY :
+         (posted->Class & events->BulkClasses) ? IDCMP_LANE_BULK :
+         IDCMP_LANE_CRITICAL;
+      batch->lanes[batch->messages[count++].lane]++;
+
+      memset(copy, 0L, sizeof(struct IntuiMessage));
+      copy->Class = posted->Class;
+      copy->Code = posted->Code;
+      copy->Qualifier = posted->Qualifier;
+      copy->IAddress = posted->IAddress;
+      copy->MouseX = window->MouseX;
+      copy->MouseY = window->MouseY;
+      copy->Seconds = posted->Seconds;
+      copy->Micros = posted->Micros;
+      copy->IDCMPWindow = window;
+
+      if (posted->Class == IDCMP_IDCMPUPDATE && posted->IAddress) {
+         record = &batch->records[batch->updates++];
+         __idcmp_decode_update__((struct TagItem *)posted->IAddress, record);
+         copy->IAddress = record->Tags;
+      }
+
+      events->PostHead++;
+   }
+
+   batch->count = count;
+   batch->full = count == IDCMP_BATCH_SIZE || 
+      batch->updates == IDCMP_UPDATE_SLOTS;
+
+   return count;
+}
+
+IDCMPState 
+ProcessIDCMPMessage(
+   IDCMPEvents *events, 
+   struct Window *window
+) {
+   IDCMPBatch *batch;
+   struct IntuiMessage *message;
+   APTR handler;
+   IDCMPMouseButton buttons = NO_BUTTON;
+   IDCMPState result = STATE_NO_CHANGE;
+   IDCMPState state;
+   ULONG flight;
+   BOOL drain = TRUE;
+
+   events->QueueDepth = 0L;
+
+   for (;;) {
+      /* Leftovers from an earlier call, or the batch of an outer loop */
+      if (NULL == (batch = __idcmp_pending_batch__(events))) {
+         if (!drain) {
             break;
+         }
 
-         case IDCMP_MOUSEBUTTONS:
-            switch (code) {
-               case SELECTUP:
-                  if ((buttons & LEFT_MOUSE_DOWN) == LEFT_MOUSE_DOWN) {
-                     buttons ^= LEFT_MOUSE_DOWN;
-                  }
+         /* Out of memory; at least keep Intuition from waiting on us */
+         if (NULL == (batch = __idcmp_free_batch__(events))) {
+            __idcmp_answer_port_verifies__(events, window, NULL);
+            break;
+         }
 
-                  buttons |= LEFT_MOUSE_UP;
-                  break;
-               
-               case SELECTDOWN:
-                  if ((buttons & LEFT_MOUSE_UP) == LEFT_MOUSE_UP) {
-                     buttons ^= LEFT_MOUSE_UP;
-                  }
+         events->QueueDepth += __idcmp_drain_port__(events, window, batch);
+         drain = batch->full;
+         continue;
+      }
 
-                  buttons |= LEFT_MOUSE_DOWN;
-                  break;
-               
-               case MENUUP:
-                  if ((buttons & RIGHT_MOUSE_DOWN) == RIGHT_MOUSE_DOWN) {
-                     buttons ^= RIGHT_MOUSE_DOWN;
-                  }
+      /* Anything that arrived behind a full batch must not wait for it */
+      __idcmp_answer_port_verifies__(events, window, batch);
+
+      /* Verify classes first, then critical classes, then bulk motion */
+      message = __idcmp_next_message__(batch);
+      handler = __idcmp_chosen_handler__(
+         events, 
+         events->Handlers ? events->Handlers : &__idcmp_no_handlers__, 
+         message
+      );
+
+      /* Recorded up front so that a handler which hangs leaves a trace */
+      flight = events->FlightCount;
+      __idcmp_record__(
+         events, FLIGHT_DISPATCH, message->Class, message->Code, 
+         handler, IDCMP_FLIGHT_RUNNING, message->Seconds, message->Micros
+      );
+
+      batch->busy++;
+      state = __idcmp_dispatch_message__(events, window, message, &buttons);
+      batch->busy--;
+
+      /* Unless a nested loop has since lapped the ring */
+      if (
+         events->FlightLog && 
+         events->FlightCount - flight <= IDCMP_FLIGHT_RECORDS
+      ) {
+         events->FlightLog[flight & (IDCMP_FLIGHT_RECORDS - 1)].State = 
+            (BYTE)state;
+      }
 
-                  buttons |= RIGHT_MOUSE_UP;
-                  break;
-               
-               case MENUDOWN:
-                  if ((buttons & RIGHT_MOUSE_UP) == LEFT_MOUSE_UP) {
-                     buttons ^= LEFT_MOUSE_UP;
-                  }
+      if (state == STATE_FINISHED) {
+         return STATE_FINISHED;
+      }
 
-                  buttons |= LEFT_MOUSE_DOWN;
-                  break;
+      if (state != STATE_NO_CHANGE) {
+         result = state;
+      }
+   }
 
-               case MIDDLEDOWN:
-                  if ((buttons & MIDDLE_MOUSE_UP) == MIDDLE_MOUSE_UP) {
-                     buttons ^= MIDDLE_MOUSE_UP;
-                  }
+   return result;
+}
 
-                  buttons |= MIDDLE_MOUSE_DOWN;
-                  break;
+IDCMPEvents *
+GetIDCMPEvents(IDCMPMessage *message) {
+   return message ? ((IDCMPBatchMessage *)message)->events : NULL;
+}
 
-               case MIDDLEUP:
-                  if ((buttons & MIDDLE_MOUSE_DOWN) == MIDDLE_MOUSE_DOWN) {
-                     buttons ^= MIDDLE_MOUSE_DOWN;
-                  }
+APTR
+GetIDCMPUserData(IDCMPMessage *message) {
+   IDCMPEvents *events = GetIDCMPEvents(message);
 
-                  buttons |= MIDDLE_MOUSE_UP;
-                  break;
+   return events ? events->UserData : NULL;
+}
 
-               default:
-                  buttons |= code;
-                  break;
-            }
-            
-            if (events->MouseButtons) {
-               return events->MouseButtons(window, message, buttons);
-            }
-            break;
+ULONG
+PollIDCMPEvents(
+   IDCMPEvents *events,
+   struct Window *window,
+   IDCMPPollBatch *batch,
+   ULONG max
+) {
+   struct IntuiMessage *message;
+   IDCMPPostedEvent *posted;
+   ULONG count = 0;
 
-         case IDCMP_MOUSEMOVE:
-            if (events->MouseMove) {
-               BOOL gz = (window->Flags & WFLG_GIMMEZEROZERO) == WFLG_GIMMEZEROZERO;
-               WORD x = gz ? window->GZZMouseX : window->MouseX;
-               WORD y = gz ? window->GZZMouseY : window->MouseY;
+   if (!events || !window || !batch) { return 0L; }
 
-               return events->MouseMove(window, message, x, y);
-            }
-            break;
+   events->VerifyScanned = NULL;
 
-         case IDCMP_NEWPREFS:
-            if (events->NewPrefs) {
-               return events->NewPrefs(window, message);
-            }
-            break;
+   if (max > IDCMP_POLL_CAPACITY) {
+      max = IDCMP_POLL_CAPACITY;
+   }
 
-         case IDCMP_NEWSIZE:
-            if (events->NewSize) {
-               return events->NewSize(window, message);
-            }
-            break;
+   while (
+      count < max && 
+      NULL != (message = (struct IntuiMessage *)GetMsg(window->UserPort))
+   ) {
+      batch->Class[count] = message->Class;
+      batch->Code[count] = message->Code;
+      batch->Qualifier[count] = message->Qualifier;
+      batch->MouseX[count] = message->MouseX;
+      batch->MouseY[count] = message->MouseY;
+      batch->Seconds[count] = message->Seconds;
+      batch->Micros[count] = message->Micros;
+      batch->IAddress[count] = message->Class == IDCMP_IDCMPUPDATE 
+         ? NULL 
+         : message->IAddress;
+
+      if (message->Class & VERIFY_IDCMP_EVENTS) {
+         if (
+            __idcmp_answer_verify__(events, window, message) == VERIFY_CANCEL &&
+            batch->Class[count] == IDCMP_MENUVERIFY &&
+            batch->Code[count] == MENUHOT
+         ) {
+            batch->Code[count] = MENUCANCEL;
+         }
+      }
+      else {
+         ReplyMsg((struct Message *)message);
+      }
 
-         case IDCMP_RAWKEY:
-            if (events->RawKey) {
-               return events->RawKey(window, message);
-            }
-            break;
+      count++;
+   }
 
-         case IDCMP_REFRESHWINDOW:
-            if (events->RefreshWindow) {
-               return events->RefreshWindow(window, message);
-            }
-            break;
+   /* Posted events follow the UserPort's, in the order posted */
+   while (count < max && events->PostHead != events->PostTail) {
+      posted = &events->Posted[events->PostHead & (IDCMP_POST_CAPACITY - 1)];
+      batch->Class[count] = posted->Class;
+      batch->Code[count] = posted->Code;
+      batch->Qualifier[count] = posted->Qualifier;
+      batch->MouseX[count] = window->MouseX;
+      batch->MouseY[count] = window->MouseY;
+      batch->Seconds[count] = posted->Seconds;
+      batch->Micros[count] = posted->Micros;
+      batch->IAddress[count] = posted->Class == IDCMP_IDCMPUPDATE 
+         ? NULL 
+         : posted->IAddress;
+
+      events->PostHead++;
+      count++;
+   }
 
-         case IDCMP_REQCLEAR:
-            if (events->ReqClear) {
-               return events->ReqClear(window, message);
-            }
-            break;
+   /* Verify messages beyond what the caller could take are still answered */
+   if (count == max) {
+      __idcmp_answer_port_verifies__(events, window, NULL);
+   }
 
-         case IDCMP_REQSET:
-            if (events->ReqSet) {
-               return events->ReqSet(window, message);
-            }
-            break;
+   batch->Count = count;
+   events->QueueDepth = count;
 
-         case IDCMP_REQVERIFY:
-            if (events->ReqVerify) {
-               return events->ReqVerify(window, message);
-            }
-            break;
+   return count;
+}
 
-         case IDCMP_SIZEVERIFY:
-            if (events->SizeVerify) {
-               return events->SizeVerify(window, message);
-            }
-            break;
+void
+ReplyIDCMPVerify(IDCMPEvents *events, IDCMPVerifyAnswer answer) {
+   struct IntuiMessage *message;
 
-         case IDCMP_VANILLAKEY:
-            if (events->VanillaKey) {
-               return events->VanillaKey(window, message);
-            }
-            break;
+   if (!events || !events->DeferredVerify) { return; }
 
-         case IDCMP_WBENCHMESSAGE:
-            if (events->WorkbenchMessage) {
-               return events->WorkbenchMessage(window, message);
-            }
-            break;
-                  
-         default:
-            break;
-      }
-   }
+   message = events->DeferredVerify;
+   events->DeferredVerify = NULL;
 
-   return  STATE_NO_CHANGE;
+   __idcmp_reply_verify__(events, message, answer);
 }
 
 void ForEachGadget(
    IDCMPEvents *events, 
    void (*Looper)(IDCMPGadget *gadget, GadgetEventNode *node, IDCMPList *list)
 ) {
-   struct List *list = events->GadgetEvents;
+   struct List *list = &events->GadgetEvents;
    struct Node *node = NULL;
 
+   events->GadgetWalkers++;
+
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       GadgetEventNode *gadgetNode = (GadgetEventNode *)node;
 
-      Looper(gadgetNode->gadget, gadgetNode, list);
+      if (gadgetNode->gadget) {
+         Looper(gadgetNode->gadget, gadgetNode, list);
+      }
+   }
+
+   events->GadgetWalkers--;
+   __idcmp_sweep_gadgets__(events);
+
+}
+
+/**
+ * Links a freshly initialised node onto the handler list and, if enabled,
+ * into the hit-test index. GADGET_VALUE is stripped; only
+ * `AddGadgetValueStream` may set it, on a node that really is a stream.
+ */
+static void
+__idcmp_link_gadget__(
+   IDCMPEvents *events,
+   GadgetEventNode *node,
+   IDCMPGadget *gadget,
+   IDCMPGadgetHandler handler,
+   GadgetEventType type
+) {
+   node->gadget = gadget;
+   node->handler = handler;
+   node->type = type & ~GADGET_VALUE;
+   node->bounds.MaxX = node->bounds.MaxY = -1;
+
+   AddTail(&events->GadgetEvents, (struct Node *)node);
+
+   if (events->HitGrid && events->HitWindow) {
+      __idcmp_hitgrid_insert__(events->HitGrid, events->HitWindow, node);
    }
+}
 
+/**
+ * Allocates a block with room for the given number of nodes.
+ */
+static struct GadgetEventBlock *
+__idcmp_alloc_gadget_block__(ULONG count) {
+   return AllocVec(
+      sizeof(struct GadgetEventBlock) + ((count - 1) * sizeof(GadgetEventNode)),
+      MEMF_CLEAR|MEMF_ANY
+   );
 }
 
 void AddGadgetHandler(
@@ -375,11 +2219,112 @@ void AddGadgetHandler(
       return;
    }
 
-   node->gadget = gadget;
-   node->handler = handler;
-   node->type = type;
+   __idcmp_link_gadget__(events, node, gadget, handler, type);
+}
+
+BOOL AddGadgetValueStream(
+   IDCMPEvents *events,
+   IDCMPGadget *gadget,
+   IDCMPValueHandler handler,
+   IDCMPValueReader reader,
+   UWORD interval
+) {
+   struct GadgetValueStream *stream;
+
+   if (!events || !gadget || !handler) { return FALSE; }
+
+   stream = AllocVec(sizeof(struct GadgetValueStream), MEMF_CLEAR|MEMF_ANY);
+   if (!stream) {
+      return FALSE;
+   }
+
+   stream->handler = handler;
+   stream->reader = reader;
+   stream->interval = interval * 1000L;
+
+   /* The node's own handler is never called for GADGET_VALUE nodes */
+   __idcmp_link_gadget__(
+      events, 
+      &stream->node, 
+      gadget, 
+      NULL, 
+      GADGET_DOWN | GADGET_UP
+   );
+   stream->node.type |= GADGET_VALUE;
+   events->ValueStreams++;
+
+   return TRUE;
+}
+
+ULONG AddGadgetHandlers(
+   IDCMPEvents *events,
+   const GadgetHandlerBinding *bindings,
+   ULONG count
+) {
+   struct GadgetEventBlock *block;
+   GadgetEventNode *node;
+   ULONG index, used = 0;
+
+   if (!events || !bindings || !count) { return 0L; }
+
+   block = __idcmp_alloc_gadget_block__(count);
+   if (!block) {
+      return 0L;
+   }
+
+   for (index = 0; index < count; index++) {
+      if (!bindings[index].gadget || !bindings[index].handler) {
+         continue;
+      }
+
+      node = &block->nodes[used++];
+      node->block = block;
+      __idcmp_link_gadget__(
+         events, 
+         node, 
+         bindings[index].gadget, 
+         bindings[index].handler, 
+         bindings[index].type
+      );
+   }
+
+   block->live = used;
+   if (!used) {
+      FreeVec(block);
+   }
+
+   return used;
+}
+
+ULONG AddGadgetChainHandlers(
+   IDCMPEvents *events,
+   IDCMPGadget *gadgets,
+   IDCMPGadgetHandler handler,
+   GadgetEventType type
+) {
+   struct GadgetEventBlock *block;
+   IDCMPGadget *gadget;
+   GadgetEventNode *node;
+   ULONG count = 0;
+
+   if (!events || !gadgets || !handler) { return 0L; }
 
-   AddTail(events->GadgetEvents, (struct Node *)node);
+   for (gadget = gadgets; gadget; gadget = gadget->NextGadget) {
+      count++;
+   }
+
+   block = __idcmp_alloc_gadget_block__(count);
+   if (!block) {
+      return 0L;
+   }
+
+   block->live = count;
+   for (gadget = gadgets, node = block->nodes; gadget; gadget = gadget->NextGadget) {
+      node->block = block;
+      __idcmp_link_gadget__(events, node++, gadget, handler, type);
+   }
+
+   return count;
 }
 
 void RemoveGadgetHandlersByType(
@@ -388,16 +2333,15 @@ void RemoveGadgetHandlersByType(
 ) {
    GadgetEventNode *eventNode = NULL;   
    IDCMPList *list;
-   struct Node *node;
+   struct Node *node, *next;
 
    if (!events) { return; }
 
-   list = events->GadgetEvents;
-   for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
+   list = &events->GadgetEvents;
+   for (node = list->lh_Head ; NULL != (next = node->ln_Succ) ; node = next) {
       eventNode = (GadgetEventNode *)node;
-      if ((eventNode->type & type) == type) {         
-         Remove(node);
-         FreeVec(eventNode);
+      if (eventNode->gadget && (eventNode->type & type) == type) {
+         __idcmp_retire_gadget__(events, eventNode);
       }
    }
 }
@@ -408,16 +2352,15 @@ void RemoveGadgetHandlersForId(
 ) {
    GadgetEventNode *eventNode = NULL;   
    IDCMPList *list;
-   struct Node *node;
+   struct Node *node, *next;
 
    if (!events) { return; }
 
-   list = events->GadgetEvents;
-   for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
+   list = &events->GadgetEvents;
+   for (node = list->lh_Head ; NULL != (next = node->ln_Succ) ; node = next) {
       eventNode = (GadgetEventNode *)node;
-      if (eventNode->gadget && eventNode->gadget->GadgetID == GadgetId) {         
-         Remove(node);
-         FreeVec(eventNode);
+      if (eventNode->gadget && eventNode->gadget->GadgetID == GadgetId) {
+         __idcmp_retire_gadget__(events, eventNode);
       }
    }
 }
@@ -429,10 +2372,10 @@ BOOL ContainsMatchingGadget(IDCMPEvents *events, IDCMPGadget *gadget) {
 
    if (!events) { return FALSE; }
 
-   list = events->GadgetEvents;
+   list = &events->GadgetEvents;
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       eventNode = (GadgetEventNode *)node;
-      if (eventNode->gadget == gadget) {
+      if (eventNode->gadget && eventNode->gadget == gadget) {
          return TRUE;
       }
    }
@@ -447,7 +2390,7 @@ IDCMPGadgetHandler GetGadgetHandlerById(IDCMPEvents *events, UWORD gadgetId) {
 
    if (!events) { return NULL; }
 
-   list = events->GadgetEvents;
+   list = &events->GadgetEvents;
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       eventNode = (GadgetEventNode *)node;
       if (eventNode->gadget && eventNode->gadget->GadgetID == gadgetId) {
@@ -468,7 +2411,7 @@ IDCMPGadgetHandler GetGadgetHandlerByPtr(
 
    if (!events) { return NULL; }
 
-   list = events->GadgetEvents;
+   list = &events->GadgetEvents;
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       eventNode = (GadgetEventNode *)node;
       if (eventNode->gadget && eventNode->gadget == gadget) {
@@ -486,7 +2429,7 @@ GadgetEventNode *GetGadgetNodeById(IDCMPEvents *events, UWORD gadgetId) {
 
    if (!events) { return NULL; }
 
-   list = events->GadgetEvents;
+   list = &events->GadgetEvents;
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       eventNode = (GadgetEventNode *)node;
       if (eventNode->gadget && eventNode->gadget->GadgetID == gadgetId) {
@@ -505,7 +2448,7 @@ GadgetEventNode *GetGadgetNodeByPtr(IDCMPEvents *events, IDCMPGadget *gadget) {
 
    if (!events) { return NULL; }
 
-   list = events->GadgetEvents;
+   list = &events->GadgetEvents;
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       eventNode = (GadgetEventNode *)node;
       if (eventNode->gadget && eventNode->gadget == gadget) {
@@ -523,7 +2466,7 @@ IDCMPGadget *FindGadgetById(IDCMPEvents *events, UWORD gadgetId) {
 
    if (!events) { return NULL; }
 
-   list = events->GadgetEvents;
+   list = &events->GadgetEvents;
    for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
       eventNode = (GadgetEventNode *)node;
       if (eventNode->gadget && eventNode->gadget->GadgetID == gadgetId) {
@@ -533,3 +2476,370 @@ IDCMPGadget *FindGadgetById(IDCMPEvents *events, UWORD gadgetId) {
 
    return NULL;
 }
+
+BOOL EnableGadgetHitTest(IDCMPEvents *events, IDCMPWindow *window) {
+   struct IDCMPHitGrid *grid;
+   struct List *list;
+   struct Node *node;
+   ULONG columns, rows, index;
+
+   if (!events || !window) { return FALSE; }
+
+   columns = (window->Width + (1 << IDCMP_HIT_CELL_SHIFT) - 1) >> IDCMP_HIT_CELL_SHIFT;
+   rows = (window->Height + (1 << IDCMP_HIT_CELL_SHIFT) - 1) >> IDCMP_HIT_CELL_SHIFT;
+   if (!columns) { columns = 1; }
+   if (!rows) { rows = 1; }
+
+   grid = AllocVec(
+      sizeof(struct IDCMPHitGrid) + (columns * rows * sizeof(UWORD)), 
+      MEMF_ANY|MEMF_CLEAR
+   );
+   if (!grid) {
+      return FALSE;
+   }
+
+   grid->width = window->Width;
+   grid->height = window->Height;
+   grid->columns = (UWORD)columns;
+   grid->rows = (UWORD)rows;
+   grid->freeEntry = IDCMP_HIT_NONE;
+   for (index = 0; index < columns * rows; index++) {
+      grid->cells[index] = IDCMP_HIT_NONE;
+   }
+
+   __idcmp_hitgrid_free__(events->HitGrid);
+   events->HitGrid = grid;
+   events->HitWindow = window;
+   events->Hover = NULL;
+
+   list = &events->GadgetEvents;
+   for (node = list->lh_Head ; node->ln_Succ != NULL ; node = node->ln_Succ) {
+      __idcmp_hitgrid_insert__(grid, window, (GadgetEventNode *)node);
+   }
+
+   return TRUE;
+}
+
+GadgetEventNode *HitTestGadget(IDCMPEvents *events, WORD x, WORD y) {
+   struct IDCMPHitGrid *grid;
+   GadgetEventNode *node;
+   UWORD index;
+
+   if (!events || !(grid = events->HitGrid) || x < 0 || y < 0) { 
+      return NULL; 
+   }
+
+   if (
+      (x >> IDCMP_HIT_CELL_SHIFT) >= grid->columns || 
+      (y >> IDCMP_HIT_CELL_SHIFT) >= grid->rows
+   ) {
+      return NULL;
+   }
+
+   index = grid->cells[
+      (y >> IDCMP_HIT_CELL_SHIFT) * grid->columns + (x >> IDCMP_HIT_CELL_SHIFT)
+   ];
+
+   while (index != IDCMP_HIT_NONE) {
+      node = grid->entries[index].node;
+
+      if (
+         x >= node->bounds.MinX && x <= node->bounds.MaxX &&
+         y >= node->bounds.MinY && y <= node->bounds.MaxY
+      ) {
+         return node;
+      }
+
+      index = grid->entries[index].next;
+   }
+
+   return NULL;
+}
+
+BOOL SetIDCMPUpdateRoute(
+   IDCMPEvents *events,
+   UWORD gadgetId,
+   IDCMPUpdateHandler handler
+) {
+   IDCMPUpdateHandler *routes;
+   ULONG count;
+
+   if (!events) { return FALSE; }
+
+   if (gadgetId >= events->UpdateRouteCount) {
+      if (!handler) { return TRUE; }
+
+      /* Doubling keeps ascending registrations to a few reallocations */
+      count = events->UpdateRouteCount 
+         ? events->UpdateRouteCount << 1 
+         : IDCMP_UPDATE_MIN_ROUTES;
+      if (count <= (ULONG)gadgetId) {
+         count = (ULONG)gadgetId + 1L;
+      }
+      if (count > 0x10000L) {
+         count = 0x10000L;
+      }
+
+      routes = AllocVec(count * sizeof(IDCMPUpdateHandler), MEMF_ANY|MEMF_CLEAR);
+      if (!routes) {
+         return FALSE;
+      }
+
+      if (events->UpdateRoutes) {
+         CopyMem(
+            events->UpdateRoutes, 
+            routes, 
+            events->UpdateRouteCount * sizeof(IDCMPUpdateHandler)
+         );
+         FreeVec(events->UpdateRoutes);
+      }
+
+      events->UpdateRoutes = routes;
+      events->UpdateRouteCount = count;
+   }
+
+   events->UpdateRoutes[gadgetId] = handler;
+
+   return TRUE;
+}
+
+BOOL AddIdleJob(IDCMPEvents *events, IDCMPIdleJob job, APTR data) {
+   IdleJobNode *node;
+
+   if (!events || !job) { return FALSE; }
+
+   node = AllocVec(sizeof(IdleJobNode), MEMF_CLEAR|MEMF_ANY);
+   if (!node) {
+      return FALSE;
+   }
+
+   node->job = job;
+   node->data = data;
+
+   AddTail(&events->IdleJobs, (struct Node *)node);
+
+   return TRUE;
+}
+
+void RemoveIdleJob(IDCMPEvents *events, IDCMPIdleJob job, APTR data) {
+   IdleJobNode *jobNode;
+   struct Node *node, *next;
+
+   if (!events) { return; }
+
+   jobNode = events->IdleRunning;
+   if (jobNode && jobNode->job == job && jobNode->data == data) {
+      events->IdleCancelled = TRUE;
+   }
+
+   for (
+      node = events->IdleJobs.lh_Head; 
+      NULL != (next = node->ln_Succ); 
+      node = next
+   ) {
+      jobNode = (IdleJobNode *)node;
+      if (jobNode->job == job && jobNode->data == data) {
+         Remove(node);
+         FreeVec(jobNode);
+      }
+   }
+}
+
+BOOL IdleSliceExpired(IDCMPIdleSlice *slice) {
+   return __idcmp_elapsed_micros__(slice->Seconds, slice->Micros) >= slice->Budget;
+}
+
+/**
+ * Moves the nodes of one list to another in constant time, leaving the
+ * source empty. Only the first and last nodes know where their header is.
+ */
+static void
+__idcmp_move_list__(struct List *to, struct List *from) {
+   if (IsListEmpty(from)) {
+      NewList(to);
+      return;
+   }
+
+   to->lh_Head = from->lh_Head;
+   to->lh_Tail = NULL;
+   to->lh_TailPred = from->lh_TailPred;
+   to->lh_Head->ln_Pred = (struct Node *)&to->lh_Head;
+   to->lh_TailPred->ln_Succ = (struct Node *)&to->lh_Tail;
+
+   NewList(from);
+}
+
+/**
+ * Exchanges the dispatch state of the events with that held by the set;
+ * pushing and popping are the same exchange but for the IDCMP flags,
+ * which change with a single ModifyIDCMP, shed classes included, so
+ * shedding ends first. An index that missed a NEWSIZE while it was out
+ * of use is brought up to date with the window.
+ */
+static void
+__idcmp_exchange_set__(
+   IDCMPEvents *events, 
+   struct Window *window, 
+   IDCMPHandlerSet *set,
+   BOOL push
+) {
+   const IDCMPHandlers *handlers = events->Handlers;
+   struct IDCMPHitGrid *grid = events->HitGrid;
+   struct Window *hitWindow = events->HitWindow;
+   IDCMPUpdateHandler *routes = events->UpdateRoutes;
+   ULONG routeCount = events->UpdateRouteCount;
+   struct GadgetValueStream *stream = events->ActiveStream;
+   UWORD streams = events->ValueStreams;
+   ULONG classes = events->ShedActive;
+   BOOL sweep = events->GadgetSweep;
+   ULONG current = 0L, flags;
+   struct List list;
+
+   if (window) {
+      if (classes) {
+         events->ShedActive = 0L;
+         events->ShedCalmWakeups = 0;
+
+         if (handlers && handlers->LoadShed) {
+            handlers->LoadShed(window, classes, FALSE);
+         }
+      }
+
+      current = window->IDCMPFlags | classes;
+      flags = push ? set->IDCMPFlags : set->RestoreFlags;
+      if (!flags) {
+         flags = current;
+      }
+
+      if (flags != window->IDCMPFlags) {
+         ModifyIDCMP(window, flags);
+      }
+   }
+
+   __idcmp_move_list__(&list, &events->GadgetEvents);
+   __idcmp_move_list__(&events->GadgetEvents, &set->GadgetEvents);
+   __idcmp_move_list__(&set->GadgetEvents, &list);
+
+   events->Handlers = set->Handlers;
+   events->HitGrid = set->HitGrid;
+   events->HitWindow = set->HitWindow;
+   events->UpdateRoutes = set->UpdateRoutes;
+   events->UpdateRouteCount = set->UpdateRouteCount;
+   events->ActiveStream = set->ActiveStream;
+   events->ValueStreams = set->ValueStreams;
+   events->GadgetSweep = set->GadgetSweep;
+   events->Hover = NULL;
+
+   set->Handlers = handlers;
+   set->HitGrid = grid;
+   set->HitWindow = hitWindow;
+   set->UpdateRoutes = routes;
+   set->UpdateRouteCount = routeCount;
+   set->ActiveStream = stream;
+   set->ValueStreams = streams;
+   set->GadgetSweep = sweep;
+   set->RestoreFlags = push ? current : 0L;
+
+   if (
+      window && events->HitGrid && events->HitWindow == window && (
+         events->HitGrid->width != window->Width || 
+         events->HitGrid->height != window->Height
+      )
+   ) {
+      __idcmp_hitgrid_resize__(events, window);
+   }
+
+   /* Nodes retired in the incoming list can go now, unless it is walked */
+   __idcmp_sweep_gadgets__(events);
+}
+
+void InitIDCMPHandlerSet(
+   IDCMPHandlerSet *set,
+   const IDCMPHandlers *handlers,
+   ULONG idcmpFlags
+) {
+   if (!set) { return; }
+
+   memset(set, 0L, sizeof(IDCMPHandlerSet));
+   NewList(&set->GadgetEvents);
+
+   set->Handlers = handlers;
+   set->IDCMPFlags = idcmpFlags;
+}
+
+BOOL PushIDCMPHandlers(
+   IDCMPEvents *events, 
+   struct Window *window, 
+   IDCMPHandlerSet *set
+) {
+   if (!events || !set || set->Pushed) { return FALSE; }
+
+   __idcmp_exchange_set__(events, window, set, TRUE);
+
+   set->Pushed = TRUE;
+   set->Previous = events->HandlerSets;
+   events->HandlerSets = set;
+
+   return TRUE;
+}
+
+IDCMPHandlerSet *PopIDCMPHandlers(IDCMPEvents *events, struct Window *window) {
+   IDCMPHandlerSet *set;
+
+   if (!events || NULL == (set = events->HandlerSets)) { return NULL; }
+
+   events->HandlerSets = set->Previous;
+   set->Previous = NULL;
+   set->Pushed = FALSE;
+
+   __idcmp_exchange_set__(events, window, set, FALSE);
+
+   /* A walker may be on one of the set's nodes; see FreeIDCMPHandlerSet */
+   if (events->GadgetWalkers && !set->Walked) {
+      set->Walked = events;
+      set->NextWalked = events->WalkedSets;
+      events->WalkedSets = set;
+   }
+
+   return set;
+}
+
+void FreeIDCMPHandlerSet(IDCMPHandlerSet *set) {
+   IDCMPEvents *events;
+   GadgetEventNode *gadgetNode;
+   struct Node *node;
+
+   if (!set || set->Pushed) { return; }
+
+   events = set->Walked;
+
+   while (NULL != (node = RemHead(&set->GadgetEvents))) {
+      if (!events) {
+         __idcmp_free_gadget_node__((GadgetEventNode *)node);
+         continue;
+      }
+
+      /* Retired into the walked list, whose walk ends in the sweep */
+      gadgetNode = (GadgetEventNode *)node;
+      gadgetNode->gadget = NULL;
+      gadgetNode->handler = NULL;
+      gadgetNode->type = 0;
+
+      AddTail(&events->GadgetEvents, node);
+      events->GadgetSweep = TRUE;
+   }
+
+   if (set->UpdateRoutes) {
+      FreeVec(set->UpdateRoutes);
+   }
+
+   __idcmp_hitgrid_free__(set->HitGrid);
+
+   set->UpdateRoutes = NULL;
+   set->UpdateRouteCount = 0;
+   set->HitGrid = NULL;
+   set->HitWindow = NULL;
+   set->ActiveStream = NULL;
+   set->ValueStreams = 0;
+   set->GadgetSweep = FALSE;
+}
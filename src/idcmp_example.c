@@ -11,7 +11,7 @@ struct IntuitionBase* IntuitionBase;
 
 VOID PrepEnvironment(VOID);
 VOID ShutdownEnvironment(VOID);
-VOID ApplyIDCMPExtras(IDCMPEvents* idcmp);
+VOID ApplyIDCMPExtras(IDCMPHandlers* handlers);
 
 IDCMPState GadgetPressed(
   IDCMPWindow *window, 
@@ -20,14 +20,17 @@ IDCMPState GadgetPressed(
 );
 
 int main(int argc, char **argv) {
+  static IDCMPHandlers handlers;
   IDCMPWindow* window = NULL;
   IDCMPEvents events;
 
   PrepEnvironment();
   
+  handlers = IDCMPBasicHandlers;
+  ApplyIDCMPExtras(&handlers);
+
   InitializeIDCMPEvents(&events);
-  ApplyIDCMPBasics(&events);
-  ApplyIDCMPExtras(&events);
+  events.Handlers = &handlers;
 
   window = OpenWindowTags(NULL,
     WA_Title, "Sample Window",
@@ -44,6 +47,8 @@ int main(int argc, char **argv) {
     HandleIDCMP(&events, window, FALSE);
   }
 
+  FreeIDCMPEvents(&events, TRUE);
+
   ShutdownEnvironment();
   return 0;
 }
@@ -74,6 +79,6 @@ IDCMPState GadgetPressed(
   return STATE_NO_CHANGE;
 }
 
-VOID ApplyIDCMPExtras(IDCMPEvents* idcmp) {
-  idcmp->GadgetDown = GadgetPressed;
+VOID ApplyIDCMPExtras(IDCMPHandlers* handlers) {
+  handlers->GadgetDown = GadgetPressed;
 }